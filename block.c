@@ -7,86 +7,1087 @@
  *
  */
 
+#define _GNU_SOURCE
+
+#include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <limits.h>
+#include <linux/falloc.h>
 
 #include "block.h"
+#include "crc32c.h"
+#include "trace.h"
 
 //Disk size set to 32MB
 #define DISK_SIZE	32*1024*1024
 
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+
 int diskfile = -1;
+static int direct_io = 0;  /* diskfile opened with O_DIRECT */
+
+/* 
+ * Striping. The block address space is split into stripes of stripe_unit
+ * blocks dealt round-robin to the backing files, so stripe s lives on disk
+ * s % num_disks. diskfile is always disks[0], which holds block 0.
+ */
+#define MAX_DISKS 16
+
+static int disks[MAX_DISKS];
+static int num_disks = 0;
+static int stripe_unit = 1;
+
+/* 
+ * One disk's share of a bio_readv()/bio_writev(): a single preadv/pwritev.
+ * Each disk past the first has a worker thread so the shares run in
+ * parallel; slot holds the job it is to run next.
+ */
+typedef struct stripe_job_t {
+    int fd;
+    off_t pos;
+    struct iovec *iov;
+    int iovcnt;
+    int write;
+    ssize_t result;
+    int done;
+} stripe_job_t;
+
+typedef struct stripe_worker_t {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    stripe_job_t *slot;
+    int stop;
+    int started;    /* thread is running and must be joined by dev_close() */
+} stripe_worker_t;
+
+static stripe_worker_t workers[MAX_DISKS];
+
+/* 
+ * RAM-resident mode. After dev_ram_load() the image lives in ram and every
+ * bio op is a memcpy; ram_dirty has a bit per block written since the last
+ * dev_ram_snapshot(). Snapshots are staged in ckpt_blks/ckpt_data until
+ * dev_ram_flush() writes them back through the journal at ckpt_path.
+ */
+#define RAM_BLOCKS	(1 << 16)	/* 256MB of address space, filled on demand */
+#define CKPT_MAGIC	0x544b4350	/* "PCKT" */
+
+static char *ram = NULL;
+static uint64_t *ram_dirty = NULL;
+static int *ckpt_blks = NULL;
+static char *ckpt_data = NULL;
+static int ckpt_count = 0;
+static pthread_mutex_t ckpt_lock = PTHREAD_MUTEX_INITIALIZER;
+static char ckpt_path[PATH_MAX];
+
+/* Journal trailer, written after ckpt records of (block number, block) */
+typedef struct ckpt_trailer_t {
+    uint32_t magic;
+    uint32_t count;
+    uint32_t stripe_unit;   /* geometry the block numbers were mapped with */
+    uint32_t crc;           /* over all records */
+} ckpt_trailer_t;
+
+static int ckpt_replay();
+
+/* 
+ * Pool of BLOCK_SIZE-aligned buffers. Up to pool_size free buffers are kept
+ * around; anything allocated past that is released as soon as it is freed so
+ * steady-state memory stays at pool_size blocks.
+ */
+static void **pool = NULL;
+static int pool_size = 0;
+static int pool_free = 0;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* 
+ * In-memory copy of the checksum region. Entry i holds the CRC32C of block i,
+ * or 0 if the block has not been written since the region was created.
+ * Changes stay in memory until dev_csum_sync() writes back the region blocks
+ * marked in csum_dirty, so a block write costs one pwrite, not two.
+ */
+static uint32_t *csum_table = NULL;
+static uint8_t *csum_dirty = NULL;
+static int csum_start = 0;
+static int csum_blocks = 0;
+static int csum_verify = 0;
+static pthread_mutex_t csum_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* 
+ * Writes in flight and writes finished, hashed by block. A block is written
+ * before its new checksum is recorded, so a verifying read racing a write
+ * can see new data against the old sum; see csum_check().
+ */
+#define CSUM_SLOTS 256
+#define CSUM_RETRIES 8		/* re-reads before a racing read goes unverified */
+#define CSUM_SPINS 1000		/* yields waiting for writes to a slot, per re-read */
+static uint32_t csum_writing[CSUM_SLOTS];
+static uint32_t csum_written[CSUM_SLOTS];
+static uint32_t csum_unverified;
+
+//Opens diskfile, bypassing the host page cache if DEV_DIRECT is set
+static int disk_open(const char* diskfile_path, int oflags, int flags) {
+    direct_io = 0;
+    if (flags & DEV_DIRECT) {
+        int fd = open(diskfile_path, oflags | O_DIRECT, S_IRUSR | S_IWUSR);
+        if (fd >= 0) {
+            direct_io = 1;
+            return fd;
+        }
+        /* Some filesystems (tmpfs) reject O_DIRECT, fall back to buffered */
+        if (errno != EINVAL)
+            return fd;
+        fprintf(stderr, "disk_open: O_DIRECT not supported, using buffered I/O\n");
+    }
+    return open(diskfile_path, oflags, S_IRUSR | S_IWUSR);
+}
+
+static void stripe_run(stripe_job_t *job) {
+    if (job->write)
+        job->result = pwritev(job->fd, job->iov, job->iovcnt, job->pos);
+    else
+        job->result = preadv(job->fd, job->iov, job->iovcnt, job->pos);
+}
+
+static void *stripe_worker_main(void *arg) {
+    stripe_worker_t *w = arg;
+    pthread_mutex_lock(&w->lock);
+    while (!w->stop) {
+        if (w->slot == NULL || w->slot->done) {
+            pthread_cond_wait(&w->cond, &w->lock);
+            continue;
+        }
+        stripe_job_t *job = w->slot;
+        pthread_mutex_unlock(&w->lock);
+        stripe_run(job);
+        pthread_mutex_lock(&w->lock);
+        job->done = 1;
+        w->slot = NULL;
+        pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+/* 
+ * Opens every file in the ':'-separated diskfile_path. With more than one,
+ * the block address space is striped across them.
+ */
+static int disks_open(const char* diskfile_path, int oflags, int flags) {
+    char paths[PATH_MAX];
+    strncpy(paths, diskfile_path, PATH_MAX-1);
+    paths[PATH_MAX-1] = 0;
+
+    char *save = NULL;
+    for (char *p = strtok_r(paths, ":", &save); p != NULL; p = strtok_r(NULL, ":", &save)) {
+        if (num_disks == MAX_DISKS) {
+            fprintf(stderr, "disk_open: at most %d backing files\n", MAX_DISKS);
+            errno = EINVAL;
+            return -1;
+        }
+        int fd = disk_open(p, oflags, flags);
+        if (fd < 0)
+            return -1;
+        disks[num_disks++] = fd;
+    }
+    if (num_disks == 0) {
+        errno = ENOENT;
+        return -1;
+    }
+    diskfile = disks[0];
+
+    strncpy(ckpt_path, diskfile_path, PATH_MAX-6);
+    ckpt_path[PATH_MAX-6] = 0;
+    ckpt_path[strcspn(ckpt_path, ":")] = 0;
+    strcat(ckpt_path, ".ckpt");
+
+    for (int d = 1; d < num_disks; d++) {
+        pthread_mutex_init(&workers[d].lock, NULL);
+        pthread_cond_init(&workers[d].cond, NULL);
+        workers[d].slot = NULL;
+        workers[d].stop = 0;
+        int err = pthread_create(&workers[d].thread, NULL, stripe_worker_main, &workers[d]);
+        if (err != 0) {
+            errno = err;
+            return -1;
+        }
+        workers[d].started = 1;
+    }
+    return 0;
+}
 
 //Creates a file which is your new emulated disk
-void dev_init(const char* diskfile_path) {
+void dev_init(const char* diskfile_path, int flags) {
     if (diskfile >= 0) {
         return;
     }
     
-    diskfile = open(diskfile_path, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
-    if (diskfile < 0) {
+    if (disks_open(diskfile_path, O_CREAT | O_RDWR, flags) < 0) {
         perror("disk_open failed");
         exit(EXIT_FAILURE);
     }
+    unlink(ckpt_path);  /* belongs to the image being replaced */
 	
-    ftruncate(diskfile, DISK_SIZE);
+    for (int d = 0; d < num_disks; d++) {
+        ftruncate(disks[d], DISK_SIZE / num_disks);
+    }
 }
 
 //Function to open the disk file
-int dev_open(const char* diskfile_path) {
+int dev_open(const char* diskfile_path, int flags) {
     if (diskfile >= 0) {
         return 0;
     }
     
-    diskfile = open(diskfile_path, O_RDWR, S_IRUSR | S_IWUSR);
-    if (diskfile < 0) {
+    if (disks_open(diskfile_path, O_RDWR, flags) < 0) {
         perror("disk_open failed");
+        dev_close();
         return -1;
     }
+    ckpt_replay();
 	return 0;
 }
 
+//Returns whether the (first) disk file exists yet
+int dev_exists(const char* diskfile_path) {
+    char path[PATH_MAX];
+    strncpy(path, diskfile_path, PATH_MAX-1);
+    path[PATH_MAX-1] = 0;
+    path[strcspn(path, ":")] = 0;
+    return access(path, F_OK) == 0;
+}
+
+int dev_num_disks() {
+    return num_disks;
+}
+
+//Sets the stripe unit, in blocks. Block 0 is on the first disk for any unit.
+void dev_set_stripe(int unit) {
+    stripe_unit = (unit > 0) ? unit : 1;
+}
+
 void dev_close() {
-    if (diskfile >= 0) {
-        close(diskfile);
+    if (num_disks > 0)
+        dev_csum_sync();
+    if (csum_unverified > 0)
+        fprintf(stderr, "block_read: %u reads left unverified, writes kept racing them\n", csum_unverified);
+    csum_unverified = 0;
+    for (int d = 1; d < num_disks; d++) {
+        if (!workers[d].started)
+            continue;
+        pthread_mutex_lock(&workers[d].lock);
+        workers[d].stop = 1;
+        pthread_cond_broadcast(&workers[d].cond);
+        pthread_mutex_unlock(&workers[d].lock);
+        pthread_join(workers[d].thread, NULL);
+        workers[d].started = 0;
+    }
+    for (int d = 0; d < num_disks; d++) {
+        close(disks[d]);
+    }
+    num_disks = 0;
+    diskfile = -1;
+
+    if (ram != NULL) {
+        munmap(ram, (size_t)RAM_BLOCKS*BLOCK_SIZE);
+        ram = NULL;
     }
+    free(ram_dirty);
+    free(ckpt_blks);
+    free(ckpt_data);
+    ram_dirty = NULL;
+    ckpt_blks = NULL;
+    ckpt_data = NULL;
+    ckpt_count = 0;
+    free(csum_table);
+    free(csum_dirty);
+    csum_table = NULL;
+    csum_dirty = NULL;
+    csum_blocks = 0;
 }
 
-//Read a block from the disk
-int bio_read(const int block_num, void *buf) {
+//Returns the fd holding block_num and its byte offset there
+static int blk_fd(const int block_num, off_t *pos) {
+    if (num_disks <= 1) {
+        *pos = (off_t)block_num*BLOCK_SIZE;
+        return diskfile;
+    }
+    int stripe = block_num / stripe_unit;
+    off_t blk = (off_t)(stripe / num_disks)*stripe_unit + block_num % stripe_unit;
+    *pos = blk*BLOCK_SIZE;
+    return disks[stripe % num_disks];
+}
+
+//Inverse of blk_fd(): the block stored at block fb of disk d
+static int blk_of(int d, off_t fb) {
+    if (num_disks <= 1)
+        return fb;
+    off_t stripe = (fb / stripe_unit) * num_disks + d;
+    return stripe*stripe_unit + fb % stripe_unit;
+}
+
+static void ram_mark(const int block_num) {
+    __sync_fetch_and_or(&ram_dirty[block_num / 64], 1ULL << (block_num % 64));
+}
+
+static int ram_covers(const int block_num) {
+    return block_num >= 0 && block_num < RAM_BLOCKS;
+}
+
+//Reads one block from memory in RAM mode, from its disk otherwise
+static ssize_t blk_pread(const int block_num, void *buf) {
+    if (ram != NULL) {
+        if (!ram_covers(block_num)) {
+            errno = EINVAL;
+            return -1;
+        }
+        memcpy(buf, ram + (size_t)block_num*BLOCK_SIZE, BLOCK_SIZE);
+        return BLOCK_SIZE;
+    }
+    off_t pos;
+    int fd = blk_fd(block_num, &pos);
+    return pread(fd, buf, BLOCK_SIZE, pos);
+}
+
+static ssize_t blk_pwrite(const int block_num, const void *buf) {
+    if (ram != NULL) {
+        if (!ram_covers(block_num)) {
+            errno = EINVAL;
+            return -1;
+        }
+        memcpy(ram + (size_t)block_num*BLOCK_SIZE, buf, BLOCK_SIZE);
+        ram_mark(block_num);
+        return BLOCK_SIZE;
+    }
+    off_t pos;
+    int fd = blk_fd(block_num, &pos);
+    return pwrite(fd, buf, BLOCK_SIZE, pos);
+}
+
+/* 
+ * Stores a block in place on its disk, punching it out if it is all zeros.
+ * data need not be aligned; it is written from bounce, a bio_buf_alloc()
+ * buffer, so O_DIRECT disks accept it.
+ */
+static int ckpt_apply(const int block_num, const char *data, char *bounce) {
+    static const char zeros[BLOCK_SIZE];
+    off_t pos;
+    int fd = blk_fd(block_num, &pos);
+    if (memcmp(data, zeros, BLOCK_SIZE) == 0 &&
+        fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos, BLOCK_SIZE) == 0)
+        return 0;
+    memcpy(bounce, data, BLOCK_SIZE);
+    return pwrite(fd, bounce, BLOCK_SIZE, pos) == BLOCK_SIZE ? 0 : -1;
+}
+
+/* 
+ * Finishes a checkpoint that was interrupted after its journal was complete.
+ * A journal without a valid trailer never got applied and is dropped. If a
+ * block cannot be written the journal is kept for the next attempt and -1
+ * is returned.
+ */
+static int ckpt_replay() {
+    int fd = open(ckpt_path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    struct stat st;
+    ckpt_trailer_t trailer;
+    size_t rec = sizeof(int32_t) + BLOCK_SIZE;
     int retstat = 0;
-    retstat = pread(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(trailer) &&
+        pread(fd, &trailer, sizeof(trailer), st.st_size - sizeof(trailer)) == sizeof(trailer) &&
+        trailer.magic == CKPT_MAGIC && (off_t)(trailer.count*rec + sizeof(trailer)) == st.st_size) {
+        char *recs = malloc(trailer.count*rec + 1);
+        if (recs == NULL)
+            retstat = -1;
+        else if (pread(fd, recs, trailer.count*rec, 0) == (ssize_t)(trailer.count*rec) &&
+            crc32c(0, recs, trailer.count*rec) == trailer.crc) {
+            int unit = stripe_unit;
+            stripe_unit = (trailer.stripe_unit > 0) ? trailer.stripe_unit : 1;
+            char *bounce = bio_buf_alloc();
+            for (uint32_t n = 0; n < trailer.count; n++) {
+                int32_t blk;
+                memcpy(&blk, recs + n*rec, sizeof(blk));
+                if (ckpt_apply(blk, recs + n*rec + sizeof(blk), bounce) < 0)
+                    retstat = -1;
+            }
+            bio_buf_free(bounce);
+            for (int d = 0; d < num_disks; d++) {
+                if (fsync(disks[d]) < 0)
+                    retstat = -1;
+            }
+            stripe_unit = unit;
+            if (retstat < 0)
+                perror("checkpoint replay failed");
+            else
+                fprintf(stderr, "dev_open: replayed checkpoint of %u blocks\n", trailer.count);
+        }
+        free(recs);
+    }
+    close(fd);
+    if (retstat == 0)
+        unlink(ckpt_path);
+    return retstat;
+}
+
+//Preallocates nbufs aligned buffers for bio_buf_alloc()
+void dev_pool_init(int nbufs) {
+    pthread_mutex_lock(&pool_lock);
+    while (pool_free > 0) {
+        free(pool[--pool_free]);
+    }
+    free(pool);
+    pool = malloc(nbufs * sizeof(void*));
+    pool_size = (pool == NULL) ? 0 : nbufs;
+    for (int i = 0; i < pool_size; i++) {
+        if (posix_memalign(&pool[pool_free], BLOCK_SIZE, BLOCK_SIZE) != 0)
+            break;
+        pool_free++;
+    }
+    pthread_mutex_unlock(&pool_lock);
+}
+
+//Returns a BLOCK_SIZE-aligned block buffer
+void *bio_buf_alloc() {
+    void *buf = NULL;
+    pthread_mutex_lock(&pool_lock);
+    if (pool_free > 0) {
+        buf = pool[--pool_free];
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    if (buf == NULL && posix_memalign(&buf, BLOCK_SIZE, BLOCK_SIZE) != 0) {
+        perror("bio_buf_alloc failed");
+        exit(EXIT_FAILURE);
+    }
+    return buf;
+}
+
+void bio_buf_free(void *buf) {
+    pthread_mutex_lock(&pool_lock);
+    if (pool_free < pool_size) {
+        pool[pool_free++] = buf;
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    free(buf);
+}
+
+//Load the checksum region covering blocks [0, num_blks*CSUM_PER_BLOCK)
+void dev_csum_init(int start_blk, int num_blks, int verify) {
+    free(csum_table);
+    free(csum_dirty);
+    csum_table = NULL;
+    csum_dirty = calloc(num_blks+1, 1);
+    if (csum_dirty == NULL ||
+        posix_memalign((void**)&csum_table, BLOCK_SIZE, (size_t)num_blks*BLOCK_SIZE) != 0) {
+        perror("csum_init failed");
+        csum_blocks = 0;
+        return;
+    }
+    memset(csum_table, 0, (size_t)num_blks*BLOCK_SIZE);  // region may lie past end of file
+    for (int i = 0; i < num_blks; i++) {
+        blk_pread(start_blk+i, (char*)csum_table + i*BLOCK_SIZE);
+    }
+    csum_start = start_blk;
+    csum_blocks = num_blks;
+    csum_verify = verify;
+}
+
+static int csum_covers(const int block_num) {
+    return block_num >= 0 && block_num < csum_blocks*CSUM_PER_BLOCK;
+}
+
+//Record a new checksum, written back by the next dev_csum_sync()
+static void csum_update(const int block_num, uint32_t sum) {
+    pthread_mutex_lock(&csum_lock);
+    csum_table[block_num] = sum;
+    csum_dirty[block_num / CSUM_PER_BLOCK] = 1;
+    pthread_mutex_unlock(&csum_lock);
+}
+
+static void csum_write_begin(const int block_num) {
+    if (csum_verify)
+        __atomic_add_fetch(&csum_writing[block_num % CSUM_SLOTS], 1, __ATOMIC_SEQ_CST);
+}
+
+static void csum_write_end(const int block_num) {
+    if (csum_verify) {
+        __atomic_add_fetch(&csum_written[block_num % CSUM_SLOTS], 1, __ATOMIC_SEQ_CST);
+        __atomic_sub_fetch(&csum_writing[block_num % CSUM_SLOTS], 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+/* 
+ * Checks buf, just read from block_num, against its checksum. On a mismatch
+ * the block is read again, waiting out writes to it, and a mismatch is only
+ * reported for a read that no write started or finished during. Writers
+ * that keep the slot busy can't hold a reader forever: after CSUM_RETRIES
+ * re-reads buf is returned unverified and counted. Returns -1 on a real
+ * mismatch.
+ */
+static int csum_check(const int block_num, void *buf) {
+    int slot = block_num % CSUM_SLOTS;
+    int clean = 0;
+    for (int retry = 0; __atomic_load_n(&csum_table[block_num], __ATOMIC_SEQ_CST) != 0 &&
+                        csum_table[block_num] != crc32c(0, buf, BLOCK_SIZE); retry++) {
+        if (clean) {
+            fprintf(stderr, "block_read: checksum mismatch on block %d\n", block_num);
+            return -1;
+        }
+        if (retry == CSUM_RETRIES) {
+            __atomic_add_fetch(&csum_unverified, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+        for (int spin = 0; spin < CSUM_SPINS && __atomic_load_n(&csum_writing[slot], __ATOMIC_SEQ_CST) != 0; spin++) {
+            sched_yield();
+        }
+        uint32_t written = __atomic_load_n(&csum_written[slot], __ATOMIC_SEQ_CST);
+        if (blk_pread(block_num, buf) <= 0)
+            memset(buf, 0, BLOCK_SIZE);
+        clean = __atomic_load_n(&csum_writing[slot], __ATOMIC_SEQ_CST) == 0 &&
+                __atomic_load_n(&csum_written[slot], __ATOMIC_SEQ_CST) == written;
+    }
+    return 0;
+}
+
+
+/* 
+ * Writes back the checksum region blocks changed since the last call.
+ * Returns -1 if any of them could not be written; those stay dirty.
+ */
+int dev_csum_sync() {
+    int retstat = 0;
+    pthread_mutex_lock(&csum_lock);
+    for (int idx = 0; idx < csum_blocks; idx++) {
+        if (!csum_dirty[idx])
+            continue;
+        if (blk_pwrite(csum_start+idx, (char*)csum_table + idx*BLOCK_SIZE) < 0) {
+            perror("csum_write failed");
+            retstat = -1;
+            continue;
+        }
+        csum_dirty[idx] = 0;
+    }
+    pthread_mutex_unlock(&csum_lock);
+    return retstat;
+}
+
+/* 
+ * Recomputes every checksum from the blocks on disk, for an image whose
+ * region may be behind its data after a crash, and writes the region back.
+ * Blocks past the end of the backing files keep a 0, i.e. no checksum.
+ */
+int dev_csum_rebuild() {
+    char *block = bio_buf_alloc();
+    pthread_mutex_lock(&csum_lock);
+    for (int b = 0; b < csum_blocks*(int)CSUM_PER_BLOCK; b++) {
+        csum_table[b] = (blk_pread(b, block) == BLOCK_SIZE) ? crc32c(0, block, BLOCK_SIZE) : 0;
+    }
+    memset(csum_dirty, 1, csum_blocks);
+    pthread_mutex_unlock(&csum_lock);
+    bio_buf_free(block);
+    return dev_csum_sync();
+}
+
+/* 
+ * Returns the fd holding block_num and stores its byte offset in *pos, so
+ * callers can move data with splice instead of going through bio_read and
+ * bio_write. Returns -1 when blocks must go through the bio path: when reads
+ * are being verified or the fd needs aligned buffers.
+ */
+int bio_map(const int block_num, off_t *pos) {
+    if (ram != NULL || csum_verify || direct_io || diskfile < 0)
+        return -1;
+    return blk_fd(block_num, pos);
+}
+
+//Forget the checksum of a block that was written around bio_write
+void bio_csum_invalidate(const int block_num) {
+    if (csum_covers(block_num) && csum_table[block_num] != 0) {
+        csum_update(block_num, 0);
+    }
+}
+
+/* 
+ * Releases blocks [block_num, block_num+count) in the backing file with
+ * PUNCH_HOLE so the host can reclaim the space. The blocks read back as
+ * zeros afterwards, so their checksums are cleared too.
+ */
+int bio_discard(const int block_num, const int count) {
+    uint64_t start = trace_begin();
+    int retstat = 0;
+    for (int b = block_num; b < block_num+count && csum_covers(b); b++) {
+        csum_write_begin(b);
+    }
+    for (int b = block_num; ram != NULL && b < block_num+count && ram_covers(b); b++) {
+        memset(ram + (size_t)b*BLOCK_SIZE, 0, BLOCK_SIZE);
+        ram_mark(b);
+    }
+    for (int b = block_num; ram == NULL && b < block_num+count; ) {
+        /* one punch per stripe unit, or for the whole range on one disk */
+        int len = (num_disks <= 1) ? block_num+count-b : MIN(stripe_unit - b % stripe_unit, block_num+count-b);
+        off_t pos;
+        int fd = blk_fd(b, &pos);
+        if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos, (off_t)len*BLOCK_SIZE) < 0) {
+            if (errno != EOPNOTSUPP)
+                perror("block_discard failed");
+            retstat = -1;
+        }
+        b += len;
+    }
+
+    /* clear checksums */
+    pthread_mutex_lock(&csum_lock);
+    for (int b = block_num; b < block_num+count && csum_covers(b); b++) {
+        csum_table[b] = 0;
+        csum_dirty[b / CSUM_PER_BLOCK] = 1;
+        csum_write_end(b);
+    }
+    pthread_mutex_unlock(&csum_lock);
+    trace_end(TR_BIO_DISCARD, block_num, 0, count*BLOCK_SIZE, start);
+    return retstat;
+}
+
+static int is_aligned(const void *buf) {
+    return ((uintptr_t)buf & (BLOCK_SIZE-1)) == 0;
+}
+
+//O_DIRECT needs aligned buffers, memory does not
+static int needs_bounce(const void *buf) {
+    return direct_io && ram == NULL && !is_aligned(buf);
+}
+
+static int block_read(const int block_num, void *buf) {
+    int retstat = 0;
+    if (needs_bounce(buf)) {
+        /* O_DIRECT needs an aligned buffer, bounce through the pool */
+        void *bounce = bio_buf_alloc();
+        retstat = block_read(block_num, bounce);
+        memcpy(buf, bounce, BLOCK_SIZE);
+        bio_buf_free(bounce);
+        return retstat;
+    }
+
+    retstat = blk_pread(block_num, buf);
     if (retstat <= 0) {
 		memset (buf, 0, BLOCK_SIZE);
 		if (retstat < 0)
 			perror("block_read failed");
     }
-    // printf("read: %d\n", block_num);
-    // for (int i=0; i < 100; i++) {
-    //     printf("%d", ((char*)buf)[i]);
-    // }
-    // printf("\n");
+    else if (csum_verify && csum_covers(block_num) && csum_check(block_num, buf) < 0) {
+        return -1;
+    }
+    return retstat;
+}
 
+static int block_write(const int block_num, const void *buf) {
+    int retstat = 0;
+    if (needs_bounce(buf)) {
+        void *bounce = bio_buf_alloc();
+        memcpy(bounce, buf, BLOCK_SIZE);
+        retstat = block_write(block_num, bounce);
+        bio_buf_free(bounce);
+        return retstat;
+    }
+
+    if (!csum_covers(block_num)) {
+        retstat = blk_pwrite(block_num, buf);
+        if (retstat < 0)
+            perror("block_write failed");
+        return retstat;
+    }
+
+    csum_write_begin(block_num);
+    retstat = blk_pwrite(block_num, buf);
+    if (retstat < 0)
+        perror("block_write failed");
+    else
+        csum_update(block_num, crc32c(0, buf, BLOCK_SIZE));
+    csum_write_end(block_num);
+    return retstat;
+}
+
+//Read a block from the disk
+int bio_read(const int block_num, void *buf) {
+    uint64_t start = trace_begin();
+    int retstat = block_read(block_num, buf);
+    trace_end(TR_BIO_READ, block_num, 0, BLOCK_SIZE, start);
     return retstat;
 }
 
 //Write a block to the disk
 int bio_write(const int block_num, const void *buf) {
-    // printf("write: %d\n", block_num);
-    // for (int i=0; i < 100; i++) {
-    //     printf("%d", ((char*)buf)[i]);
-    // }
-    // printf("\n");
+    uint64_t start = trace_begin();
+    int retstat = block_write(block_num, buf);
+    trace_end(TR_BIO_WRITE, block_num, 0, BLOCK_SIZE, start);
+    return retstat;
+}
+
+/* 
+ * Moves count consecutive blocks starting at block_num between the disks and
+ * buf. Each disk gets a single preadv/pwritev covering its stripes of the
+ * range, and the disks run in parallel. Returns 0, or -1 if a disk returned
+ * short so the caller can fall back to single blocks.
+ */
+static int stripe_rw(const int block_num, const int count, char *buf, int write) {
+    if (ram != NULL) {
+        if (!ram_covers(block_num) || !ram_covers(block_num+count-1))
+            return -1;
+        char *mem = ram + (size_t)block_num*BLOCK_SIZE;
+        if (write) {
+            memcpy(mem, buf, (size_t)count*BLOCK_SIZE);
+            for (int b = block_num; b < block_num+count; b++)
+                ram_mark(b);
+        }
+        else {
+            memcpy(buf, mem, (size_t)count*BLOCK_SIZE);
+        }
+        return 0;
+    }
+
+    stripe_job_t jobs[MAX_DISKS];
+    int ndisks = (num_disks > 1) ? num_disks : 1;
+    int chunks = (num_disks > 1) ? count / stripe_unit + 2 : 1;
+    struct iovec *iov = malloc((size_t)ndisks * MIN(chunks, IOV_MAX) * sizeof(struct iovec));
+    memset(jobs, 0, sizeof(jobs));
+    for (int d = 0; d < ndisks; d++) {
+        jobs[d].iov = iov + d*MIN(chunks, IOV_MAX);
+        jobs[d].write = write;
+        jobs[d].fd = -1;
+    }
+
+    /* stripes of one disk are adjacent in its file, so they chain into one iovec list */
+    for (int b = block_num; b < block_num+count; ) {
+        int len = (num_disks <= 1) ? count : MIN(stripe_unit - b % stripe_unit, block_num+count-b);
+        off_t pos;
+        int fd = blk_fd(b, &pos);
+        int d = (num_disks <= 1) ? 0 : (b / stripe_unit) % num_disks;
+        if (jobs[d].iovcnt == IOV_MAX) {
+            free(iov);
+            return -1;
+        }
+        if (jobs[d].fd < 0) {
+            jobs[d].fd = fd;
+            jobs[d].pos = pos;
+        }
+        jobs[d].iov[jobs[d].iovcnt].iov_base = buf + (size_t)(b - block_num)*BLOCK_SIZE;
+        jobs[d].iov[jobs[d].iovcnt].iov_len = (size_t)len*BLOCK_SIZE;
+        jobs[d].iovcnt++;
+        b += len;
+    }
+
+    /* hand other disks to their workers, run the first share here */
+    int mine = -1;
+    for (int d = 0; d < ndisks; d++) {
+        if (jobs[d].iovcnt == 0)
+            continue;
+        if (mine < 0) {
+            mine = d;  /* first share runs here, so disk 0 never needs a worker */
+            continue;
+        }
+        stripe_worker_t *w = &workers[d];
+        pthread_mutex_lock(&w->lock);
+        while (w->slot != NULL)
+            pthread_cond_wait(&w->cond, &w->lock);
+        w->slot = &jobs[d];
+        pthread_cond_broadcast(&w->cond);
+        pthread_mutex_unlock(&w->lock);
+    }
+    stripe_run(&jobs[mine]);
+    jobs[mine].done = 1;
+
     int retstat = 0;
-    retstat = pwrite(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
-    if (retstat < 0) {
-        perror("block_write failed");
+    for (int d = 0; d < ndisks; d++) {
+        if (jobs[d].iovcnt == 0)
+            continue;
+        if (d != mine) {
+            stripe_worker_t *w = &workers[d];
+            pthread_mutex_lock(&w->lock);
+            while (!jobs[d].done)
+                pthread_cond_wait(&w->cond, &w->lock);
+            pthread_mutex_unlock(&w->lock);
+        }
+        size_t want = 0;
+        for (int i = 0; i < jobs[d].iovcnt; i++)
+            want += jobs[d].iov[i].iov_len;
+        if (jobs[d].result != (ssize_t)want)
+            retstat = -1;
     }
+    free(iov);
     return retstat;
 }
 
+static int block_readv(const int block_num, const int count, void *buf) {
+    if (needs_bounce(buf) || stripe_rw(block_num, count, buf, 0) < 0) {
+        /* unaligned for O_DIRECT, or ran into the end of a disk */
+        for (int n = 0; n < count; n++) {
+            if (block_read(block_num+n, (char*)buf + (size_t)n*BLOCK_SIZE) < 0)
+                return -1;
+        }
+        return count*BLOCK_SIZE;
+    }
+
+    for (int n = 0; csum_verify && n < count; n++) {
+        int b = block_num+n;
+        if (csum_covers(b) && csum_check(b, (char*)buf + (size_t)n*BLOCK_SIZE) < 0)
+            return -1;
+    }
+    return count*BLOCK_SIZE;
+}
+
+//Writes count blocks one at a time, for when one pwritev per disk won't do
+static int block_writev_each(const int block_num, const int count, const void *buf) {
+    for (int n = 0; n < count; n++) {
+        if (block_write(block_num+n, (const char*)buf + (size_t)n*BLOCK_SIZE) < 0)
+            return -1;
+    }
+    return count*BLOCK_SIZE;
+}
+
+static int block_writev(const int block_num, const int count, const void *buf) {
+    if (needs_bounce(buf))
+        return block_writev_each(block_num, count, buf);
+
+    /* new checksums, computed before taking the lock */
+    int n = 0;
+    uint32_t sums[count];
+    for (; n < count && csum_covers(block_num+n); n++) {
+        sums[n] = crc32c(0, (const char*)buf + (size_t)n*BLOCK_SIZE, BLOCK_SIZE);
+        csum_write_begin(block_num+n);
+    }
+    int retstat = stripe_rw(block_num, count, (char*)buf, 1);
+    if (retstat >= 0) {
+        pthread_mutex_lock(&csum_lock);
+        for (int i = 0; i < n; i++) {
+            csum_table[block_num+i] = sums[i];
+            csum_dirty[(block_num+i) / CSUM_PER_BLOCK] = 1;
+        }
+        pthread_mutex_unlock(&csum_lock);
+    }
+    for (int i = 0; i < n; i++) {
+        csum_write_end(block_num+i);
+    }
+
+    /* ran into the end of a disk */
+    if (retstat < 0)
+        return block_writev_each(block_num, count, buf);
+    return count*BLOCK_SIZE;
+}
+
+//Read count consecutive blocks starting at block_num into buf
+int bio_readv(const int block_num, const int count, void *buf) {
+    uint64_t start = trace_begin();
+    int retstat = block_readv(block_num, count, buf);
+    trace_end(TR_BIO_READV, block_num, 0, count*BLOCK_SIZE, start);
+    return retstat;
+}
+
+//Write count consecutive blocks starting at block_num from buf
+int bio_writev(const int block_num, const int count, const void *buf) {
+    uint64_t start = trace_begin();
+    int retstat = block_writev(block_num, count, buf);
+    trace_end(TR_BIO_WRITEV, block_num, 0, count*BLOCK_SIZE, start);
+    return retstat;
+}
+
+/* 
+ * Moves the image into anonymous memory. From here on every bio op is a
+ * memcpy and the backing files, if any, are only written by
+ * dev_ram_flush(). Call once the stripe geometry is set. Holes in the
+ * backing files are skipped, so only blocks in use take up memory.
+ */
+int dev_ram_load() {
+    ram = mmap(NULL, (size_t)RAM_BLOCKS*BLOCK_SIZE, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (ram == MAP_FAILED) {
+        ram = NULL;
+        perror("dev_ram_load failed");
+        return -1;
+    }
+    ram_dirty = calloc(RAM_BLOCKS / 64, sizeof(uint64_t));
+    if (ram_dirty == NULL) {
+        munmap(ram, (size_t)RAM_BLOCKS*BLOCK_SIZE);
+        ram = NULL;
+        perror("dev_ram_load failed");
+        return -1;
+    }
+
+    void *block = bio_buf_alloc();
+    for (int d = 0; d < num_disks; d++) {
+        off_t data = 0, hole;
+        while ((data = lseek(disks[d], data, SEEK_DATA)) >= 0) {
+            hole = lseek(disks[d], data, SEEK_HOLE);
+            for (off_t fb = data / BLOCK_SIZE; fb*BLOCK_SIZE < hole; fb++) {
+                int b = blk_of(d, fb);
+                if (ram_covers(b) && pread(disks[d], block, BLOCK_SIZE, fb*BLOCK_SIZE) > 0)
+                    memcpy(ram + (size_t)b*BLOCK_SIZE, block, BLOCK_SIZE);
+            }
+            data = hole;
+        }
+    }
+    bio_buf_free(block);
+    return 0;
+}
+
+//Makes room for count saved blocks, keeping the old buffers on failure
+static int ckpt_grow(int count) {
+    int *blks = realloc(ckpt_blks, count * sizeof(int));
+    if (blks == NULL)
+        return -1;
+    ckpt_blks = blks;
+    char *data = realloc(ckpt_data, (size_t)count * BLOCK_SIZE);
+    if (data == NULL)
+        return -1;
+    ckpt_data = data;
+    return 0;
+}
+
+/* 
+ * Copies every block written since the last snapshot aside for
+ * dev_ram_flush(). The caller keeps the filesystem quiet meanwhile so the
+ * snapshot is consistent; it only costs a memcpy per dirty block. Returns
+ * the number of blocks copied, or -1 if there was no memory to copy them
+ * to. Blocks that were not copied stay dirty for the next snapshot.
+ */
+int dev_ram_snapshot() {
+    if (ram == NULL)
+        return 0;
+
+    pthread_mutex_lock(&ckpt_lock);
+    int dirty = 0;
+    for (int w = 0; w < RAM_BLOCKS / 64; w++) {
+        dirty += __builtin_popcountll(ram_dirty[w]);
+    }
+    if (dirty > 0 && ckpt_grow(ckpt_count + dirty) < 0) {
+        pthread_mutex_unlock(&ckpt_lock);
+        perror("dev_ram_snapshot failed");
+        return -1;
+    }
+
+    /* blocks dirtied since the count still get copied, the buffers grow */
+    int copied = 0;
+    for (int w = 0; w < RAM_BLOCKS / 64; w++) {
+        uint64_t bits = __sync_fetch_and_and(&ram_dirty[w], 0);
+        while (bits != 0) {
+            int b = w*64 + __builtin_ctzll(bits);
+            if (copied == dirty) {
+                dirty += dirty / 2 + 64;
+                if (ckpt_grow(ckpt_count + dirty) < 0) {
+                    __sync_fetch_and_or(&ram_dirty[w], bits);
+                    pthread_mutex_unlock(&ckpt_lock);
+                    perror("dev_ram_snapshot failed");
+                    return -1;
+                }
+            }
+            bits &= bits - 1;
+            ckpt_blks[ckpt_count] = b;
+            memcpy(ckpt_data + (size_t)ckpt_count*BLOCK_SIZE, ram + (size_t)b*BLOCK_SIZE, BLOCK_SIZE);
+            ckpt_count++;
+            copied++;
+        }
+    }
+    pthread_mutex_unlock(&ckpt_lock);
+    return copied;
+}
+
+//Marks blocks dirty again so the next dev_ram_snapshot() picks them up
+static void ram_redirty(const int *blks, int count) {
+    for (int n = 0; n < count; n++) {
+        __sync_fetch_and_or(&ram_dirty[blks[n] / 64], 1ULL << (blks[n] % 64));
+    }
+}
+
+/* 
+ * Writes the blocks saved by dev_ram_snapshot() back to the backing files.
+ * They go to the journal first, which is synced before any block is
+ * overwritten in place, so a crash leaves either the old or the new
+ * checkpoint. Needs no filesystem lock. Returns -1 on failure. If the
+ * journal could not be written the backing files are untouched and the
+ * blocks are marked dirty again. If a block could not be written in place
+ * the journal is kept, and it is replayed before the next checkpoint
+ * writes a new one.
+ */
+int dev_ram_flush() {
+    pthread_mutex_lock(&ckpt_lock);
+    int count = ckpt_count;
+    int *blks = ckpt_blks;
+    char *data = ckpt_data;
+    ckpt_count = 0;
+    ckpt_blks = NULL;
+    ckpt_data = NULL;
+    pthread_mutex_unlock(&ckpt_lock);
+
+    if (count == 0 || num_disks == 0) {
+        free(blks);
+        free(data);
+        return 0;
+    }
+
+    /* a journal left by a failed flush must land before it is replaced */
+    if (ckpt_replay() < 0) {
+        ram_redirty(blks, count);
+        free(blks);
+        free(data);
+        return -1;
+    }
+
+    /* journal: (block number, block) records, then the trailer */
+    size_t rec = sizeof(int32_t) + BLOCK_SIZE;
+    char *recs = malloc(count*rec);
+    if (recs == NULL) {
+        perror("checkpoint journal failed");
+        ram_redirty(blks, count);
+        free(blks);
+        free(data);
+        return -1;
+    }
+    for (int n = 0; n < count; n++) {
+        int32_t blk = blks[n];
+        memcpy(recs + n*rec, &blk, sizeof(blk));
+        memcpy(recs + n*rec + sizeof(blk), data + (size_t)n*BLOCK_SIZE, BLOCK_SIZE);
+    }
+    ckpt_trailer_t trailer = { CKPT_MAGIC, count, stripe_unit, crc32c(0, recs, count*rec) };
+
+    int retstat = -1;
+    int fd = open(ckpt_path, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);
+    if (fd >= 0 && write(fd, recs, count*rec) == (ssize_t)(count*rec) &&
+        write(fd, &trailer, sizeof(trailer)) == sizeof(trailer) && fsync(fd) == 0) {
+        retstat = 0;
+        char *bounce = bio_buf_alloc();
+        for (int n = 0; n < count; n++) {
+            if (ckpt_apply(blks[n], data + (size_t)n*BLOCK_SIZE, bounce) < 0)
+                retstat = -1;
+        }
+        bio_buf_free(bounce);
+        for (int d = 0; d < num_disks; d++) {
+            if (fsync(disks[d]) < 0)
+                retstat = -1;
+        }
+        if (retstat == 0)
+            unlink(ckpt_path);
+        else
+            perror("checkpoint write failed, journal kept");
+    }
+    else {
+        perror("checkpoint journal failed");
+        ram_redirty(blks, count);
+    }
+    if (fd >= 0)
+        close(fd);
+    free(recs);
+    free(blks);
+    free(data);
+    return retstat;
+}
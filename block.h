@@ -8,12 +8,43 @@
 #ifndef _BLOCK_H_
 #define _BLOCK_H_
 
+#include <stdint.h>
+#include <sys/types.h>
+
 #define BLOCK_SIZE 4096
 
-void dev_init(const char* diskfile_path);
-int dev_open(const char* diskfile_path);
+/* Checksums stored per block of the checksum region */
+#define CSUM_PER_BLOCK (BLOCK_SIZE/sizeof(uint32_t))
+
+/* 
+ * dev_init/dev_open take a ':'-separated list of backing files; with more
+ * than one, blocks are striped across them (see dev_set_stripe()).
+ */
+
+/* dev_init/dev_open flags */
+#define DEV_DIRECT 0x1	/* open with O_DIRECT, bypassing the host page cache */
+
+void dev_init(const char* diskfile_path, int flags);
+int dev_open(const char* diskfile_path, int flags);
+int dev_exists(const char* diskfile_path);
+int dev_num_disks();
+void dev_set_stripe(int unit);
 void dev_close();
+int dev_ram_load();
+int dev_ram_snapshot();
+int dev_ram_flush();
+void dev_csum_init(int start_blk, int num_blks, int verify);
+int dev_csum_sync();
+int dev_csum_rebuild();
+void dev_pool_init(int nbufs);
+void *bio_buf_alloc();
+void bio_buf_free(void *buf);
 int bio_read(const int block_num, void *buf);
 int bio_write(const int block_num, const void *buf);
+int bio_readv(const int block_num, const int count, void *buf);
+int bio_writev(const int block_num, const int count, const void *buf);
+int bio_map(const int block_num, off_t *pos);
+void bio_csum_invalidate(const int block_num);
+int bio_discard(const int block_num, const int count);
 
 #endif
@@ -0,0 +1,171 @@
+/*
+ *  Copyright (C) 2021 CS416 Rutgers CS
+ *	
+ *	Tiny File System
+ *
+ *	File:	crc32c.c
+ *
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "crc32c.h"
+
+/* Castagnoli polynomial, bit-reflected */
+#define POLY	0x82F63B78
+
+/* Bytes per lane in the interleaved hardware loop */
+#define LANE	680
+
+static uint32_t sw_table[8][256];
+static uint32_t shift1_table[4][256];  // advances a crc over LANE zero bytes
+static uint32_t shift2_table[4][256];  // advances a crc over 2*LANE zero bytes
+static uint32_t (*crc32c_impl)(uint32_t, const unsigned char *, size_t);
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+
+/* 
+ * Slicing-by-8 software fallback, consumes 8 bytes per iteration. Works on 
+ * the raw crc (no pre/post inversion).
+ */
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len) {
+    while (len && ((uintptr_t)p & 7)) {
+        crc = sw_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        word ^= crc;
+        crc = sw_table[7][word & 0xff] ^
+              sw_table[6][(word >> 8) & 0xff] ^
+              sw_table[5][(word >> 16) & 0xff] ^
+              sw_table[4][(word >> 24) & 0xff] ^
+              sw_table[3][(word >> 32) & 0xff] ^
+              sw_table[2][(word >> 40) & 0xff] ^
+              sw_table[1][(word >> 48) & 0xff] ^
+              sw_table[0][word >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        crc = sw_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+
+#if defined(__x86_64__)
+
+static inline uint32_t crc_shift(uint32_t table[4][256], uint32_t crc) {
+    return table[0][crc & 0xff] ^ table[1][(crc >> 8) & 0xff] ^
+           table[2][(crc >> 16) & 0xff] ^ table[3][crc >> 24];
+}
+
+/* 
+ * SSE4.2 version. The crc32 instruction has a 3 cycle latency but single
+ * cycle throughput, so buffers are split into three independent lanes whose
+ * results are merged with the precomputed shift tables.
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len) {
+    uint64_t crc0 = crc;
+    while (len && ((uintptr_t)p & 7)) {
+        crc0 = __builtin_ia32_crc32qi(crc0, *p++);
+        len--;
+    }
+
+    while (len >= 3*LANE) {
+        uint64_t crc1 = 0, crc2 = 0;
+        const unsigned char *end = p + LANE;
+        while (p < end) {
+            uint64_t w0, w1, w2;
+            memcpy(&w0, p, 8);
+            memcpy(&w1, p+LANE, 8);
+            memcpy(&w2, p+2*LANE, 8);
+            crc0 = __builtin_ia32_crc32di(crc0, w0);
+            crc1 = __builtin_ia32_crc32di(crc1, w1);
+            crc2 = __builtin_ia32_crc32di(crc2, w2);
+            p += 8;
+        }
+        crc0 = crc_shift(shift2_table, crc0) ^ crc_shift(shift1_table, crc1) ^ crc2;
+        p += 2*LANE;
+        len -= 3*LANE;
+    }
+
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        crc0 = __builtin_ia32_crc32di(crc0, word);
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        crc0 = __builtin_ia32_crc32qi(crc0, *p++);
+    }
+    return crc0;
+}
+
+#endif
+
+
+/* 
+ * Builds table so that crc_shift(table, x) == crc of x followed by len zero
+ * bytes. The operation is linear, so compute it for each single bit and
+ * combine.
+ */
+static void shift_table_init(uint32_t table[4][256], size_t len) {
+    static const unsigned char zeros[2*LANE];
+    uint32_t basis[32];
+    for (int k=0; k < 32; k++) {
+        basis[k] = crc32c_sw(1u << k, zeros, len);
+    }
+    for (int b=0; b < 4; b++) {
+        for (int v=0; v < 256; v++) {
+            uint32_t crc = 0;
+            for (int k=0; k < 8; k++) {
+                if (v & (1 << k))
+                    crc ^= basis[b*8+k];
+            }
+            table[b][v] = crc;
+        }
+    }
+}
+
+
+static void crc32c_init() {
+    for (int i=0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int j=0; j < 8; j++) {
+            crc = (crc & 1) ? (crc >> 1) ^ POLY : crc >> 1;
+        }
+        sw_table[0][i] = crc;
+    }
+    for (int i=0; i < 256; i++) {
+        for (int t=1; t < 8; t++) {
+            sw_table[t][i] = sw_table[0][sw_table[t-1][i] & 0xff] ^ (sw_table[t-1][i] >> 8);
+        }
+    }
+    crc32c_impl = crc32c_sw;
+
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        shift_table_init(shift1_table, LANE);
+        shift_table_init(shift2_table, 2*LANE);
+        crc32c_impl = crc32c_hw;
+    }
+#endif
+}
+
+
+/* 
+ * Computes CRC32C of buf, continuing from a previous crc (pass 0 to start).
+ * Uses SSE4.2 when the cpu has it and slicing-by-8 otherwise.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+    pthread_once(&crc32c_once, crc32c_init);
+    return ~crc32c_impl(~crc, buf, len);
+}
@@ -0,0 +1,513 @@
+/*
+ *  Copyright (C) 2021 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	mktfs.c
+ *
+ *	Offline image builder. Makes a new image and, with -d, fills it with a
+ *	copy of a host directory tree without going through FUSE. The tree is
+ *	scanned in parallel, every inode and block is placed in one pass (each
+ *	file gets one contiguous extent), then file data is copied in parallel
+ *	and the inode table and bitmaps are written once at the end.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <limits.h>
+
+#include "block.h"
+#include "tfs.h"
+
+#define MAX(x, y) (((x) > (y)) ? (x) : (y))
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+
+#define INODE_PER_BLK	(BLOCK_SIZE / sizeof(inode_t))
+#define DIRENT_PER_BLK	(BLOCK_SIZE / sizeof(dirent_t))
+#define COPY_CHUNK		256		/* blocks per read and bio_writev, 1MB */
+#define MAX_TARGETS		16		/* backing files dev_init() takes */
+
+
+/* A file or directory of the host tree, indexed by its inode number */
+typedef struct node_t {
+	char		*path;			/* host path */
+	const char	*name;			/* last component of path */
+	uint16_t	parent;
+	uint32_t	type;
+	off_t		size;			/* files only */
+	uint16_t	*children;		/* directories only */
+	int			num_children;
+	int			first_blk;		/* data or dirent blocks, then indirect blocks */
+	int			num_blks;
+	int			num_ind;
+} node_t;
+
+
+/************** Static Variables **************/
+
+static superblock_t superblock;
+static int nthreads;
+
+static node_t nodes[MAX_INUM];
+static int num_nodes;
+
+/* Directories waiting to be scanned */
+static uint16_t dir_queue[MAX_INUM];
+static int queue_head, queue_tail, scanning;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+/* Backing files named on the command line, built as temporaries first */
+static char targets[MAX_TARGETS][PATH_MAX];
+static char temps[MAX_TARGETS][PATH_MAX];
+static int num_targets;
+
+static inode_t *inodes;			/* in-memory inode table */
+static volatile int next_work;
+static volatile bool failed;
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static void fail(const char *fmt, const char *path) {
+	pthread_mutex_lock(&report_lock);
+	fprintf(stderr, "mktfs: ");
+	fprintf(stderr, fmt, path);
+	fprintf(stderr, "\n");
+	failed = true;
+	pthread_mutex_unlock(&report_lock);
+}
+
+
+static void run_threads(void *(*fn)(void *)) {
+	pthread_t threads[nthreads];
+	next_work = 0;
+	for (int i=0; i < nthreads; i++) {
+		pthread_create(&threads[i], NULL, fn, NULL);
+	}
+	for (int i=0; i < nthreads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+}
+
+
+/************** Scan **************/
+
+static void queue_push(uint16_t ino) {
+	pthread_mutex_lock(&queue_lock);
+	dir_queue[queue_tail++] = ino;
+	pthread_cond_signal(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+}
+
+
+/*
+ * Reads one host directory and makes a node for every file and directory
+ * in it. Inode numbers are handed out as entries are found. Other file
+ * types are skipped.
+ */
+static void scan_dir(uint16_t ino) {
+	node_t *dir = &nodes[ino];
+	DIR *d = opendir(dir->path);
+	if (d == NULL) {
+		fail("cannot read directory %s", dir->path);
+		return;
+	}
+
+	int cap = 0;
+	struct dirent *ent;
+	while ((ent = readdir(d)) != NULL && !failed) {
+		if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+			continue;
+
+		size_t len = strlen(dir->path) + strlen(ent->d_name) + 2;
+		char *path = malloc(len);
+		snprintf(path, len, "%s/%s", dir->path, ent->d_name);
+		struct stat st;
+		if (lstat(path, &st) < 0 || !(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode))) {
+			fprintf(stderr, "mktfs: skipping %s, not a file or directory\n", path);
+			free(path);
+			continue;
+		}
+		if (strlen(ent->d_name) > 207) {
+			fail("name too long: %s", path);
+			free(path);
+			break;
+		}
+		if (S_ISREG(st.st_mode) && st.st_size > (off_t)MAX_FILE_BLKS * BLOCK_SIZE) {
+			fail("file too large: %s", path);
+			free(path);
+			break;
+		}
+
+		int child = __sync_fetch_and_add(&num_nodes, 1);
+		if (child >= MAX_INUM) {
+			fail("too many files and directories under %s", nodes[ROOT_INO].path);
+			free(path);
+			break;
+		}
+		node_t *node = &nodes[child];
+		node->path = path;
+		node->name = path + strlen(dir->path) + 1;
+		node->parent = ino;
+		node->type = S_ISDIR(st.st_mode) ? TYPE_DIR : TYPE_FILE;
+		node->size = S_ISREG(st.st_mode) ? st.st_size : 0;
+
+		if (dir->num_children == cap) {
+			cap = cap ? cap*2 : 16;
+			dir->children = realloc(dir->children, cap * sizeof(uint16_t));
+		}
+		dir->children[dir->num_children++] = child;
+		if (node->type == TYPE_DIR)
+			queue_push(child);
+	}
+	closedir(d);
+}
+
+
+/*
+ * Scan threads take directories off the queue until it is empty and no
+ * other thread is still scanning one, which could add more.
+ */
+static void *scan_main(void *arg) {
+	pthread_mutex_lock(&queue_lock);
+	for (;;) {
+		while (queue_head == queue_tail && scanning > 0)
+			pthread_cond_wait(&queue_cond, &queue_lock);
+		if (queue_head == queue_tail)
+			break;
+		uint16_t ino = dir_queue[queue_head++];
+		scanning++;
+		pthread_mutex_unlock(&queue_lock);
+
+		scan_dir(ino);
+
+		pthread_mutex_lock(&queue_lock);
+		scanning--;
+		pthread_cond_broadcast(&queue_cond);
+	}
+	pthread_mutex_unlock(&queue_lock);
+	return NULL;
+}
+
+
+/************** Layout **************/
+
+/*
+ * Gives every node its blocks: first the dirent blocks of all directories,
+ * so metadata sits together, then each file's data as one extent followed
+ * by its indirect blocks. Returns the number of data blocks used, or -1 if
+ * the tree does not fit.
+ */
+static int layout() {
+	int used = 0;
+	for (int pass=0; pass < 2; pass++) {
+		for (int i=0; i < num_nodes; i++) {
+			node_t *node = &nodes[i];
+			if ((pass == 0) != (node->type == TYPE_DIR))
+				continue;
+
+			if (node->type == TYPE_DIR) {
+				int entries = node->num_children + (i == ROOT_INO ? 1 : 2);
+				node->num_blks = (entries + DIRENT_PER_BLK-1) / DIRENT_PER_BLK;
+				if (node->num_blks > NUM_DIRECT) {
+					fail("too many entries in %s", node->path);
+					return -1;
+				}
+			}
+			else {
+				node->num_blks = (node->size + BLOCK_SIZE-1) / BLOCK_SIZE;
+				if (node->num_blks > NUM_DIRECT)
+					node->num_ind = (node->num_blks - NUM_DIRECT + PTRS_PER_BLK-1) / PTRS_PER_BLK;
+			}
+			node->first_blk = superblock.d_start_blk + used;
+			used += node->num_blks + node->num_ind;
+		}
+	}
+	if (used > MAX_DNUM) {
+		fprintf(stderr, "mktfs: tree needs %d data blocks, the image has %d\n", used, MAX_DNUM);
+		return -1;
+	}
+	return used;
+}
+
+
+/************** Write **************/
+
+static void fill_dirent(dirent_t *dirent, uint16_t ino, const char *name) {
+	dirent->valid = 1;
+	dirent->ino = ino;
+	dirent->name_len = strlen(name);
+	strncpy(dirent->name, name, sizeof(dirent->name) - 1);
+}
+
+
+static void write_dir(uint16_t ino, inode_t *inode) {
+	node_t *node = &nodes[ino];
+	dirent_t *dirents = calloc(node->num_blks * DIRENT_PER_BLK, sizeof(dirent_t));
+	int n = 0;
+
+	/* same entries tfs_mkfs() and tfs_mkdir() start a directory with */
+	fill_dirent(&dirents[n++], ino, ".");
+	if (ino != ROOT_INO)
+		fill_dirent(&dirents[n++], node->parent, "..");
+	for (int c=0; c < node->num_children; c++) {
+		uint16_t child = node->children[c];
+		fill_dirent(&dirents[n++], child, nodes[child].name);
+		if (nodes[child].type == TYPE_DIR)
+			inode->link++;
+	}
+
+	bio_writev(node->first_blk, node->num_blks, dirents);
+	for (int i=0; i < node->num_blks; i++) {
+		inode->direct_ptr[i] = node->first_blk + i;
+	}
+	free(dirents);
+}
+
+
+/*
+ * Copies a host file into its extent and points the inode at it. A file
+ * that shrank since the scan is padded with zeros, one that grew is cut
+ * at the scanned size.
+ */
+static void write_file(uint16_t ino, inode_t *inode, char *buf) {
+	node_t *node = &nodes[ino];
+	inode->size = node->size;
+	if (node->num_blks == 0)
+		return;
+
+	int fd = open(node->path, O_RDONLY);
+	if (fd < 0) {
+		fail("cannot read %s", node->path);
+		return;
+	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	for (int b=0; b < node->num_blks; b += COPY_CHUNK) {
+		int count = MIN(COPY_CHUNK, node->num_blks - b);
+		size_t want = (size_t)count * BLOCK_SIZE, got = 0;
+		while (got < want) {
+			ssize_t n = pread(fd, buf + got, want - got, (off_t)b*BLOCK_SIZE + got);
+			if (n <= 0)
+				break;
+			got += n;
+		}
+		if ((off_t)b*BLOCK_SIZE + got > node->size)
+			got = node->size - (off_t)b*BLOCK_SIZE;
+		memset(buf + got, 0, want - got);
+		bio_writev(node->first_blk + b, count, buf);
+	}
+	close(fd);
+
+	for (int i=0; i < NUM_DIRECT && i < node->num_blks; i++) {
+		inode->direct_ptr[i] = node->first_blk + i;
+	}
+	if (node->num_ind > 0) {
+		int *ind = (int*)buf;
+		memset(ind, 0xFF, (size_t)node->num_ind * BLOCK_SIZE);
+		for (int i=NUM_DIRECT; i < node->num_blks; i++) {
+			ind[i - NUM_DIRECT] = node->first_blk + i;
+		}
+		int ind_blk = node->first_blk + node->num_blks;
+		bio_writev(ind_blk, node->num_ind, ind);
+		for (int k=0; k < node->num_ind; k++) {
+			inode->indirect_ptr[k] = ind_blk + k;
+		}
+	}
+}
+
+
+static void *write_main(void *arg) {
+	char *buf;
+	if (posix_memalign((void**)&buf, BLOCK_SIZE, MAX(COPY_CHUNK, NUM_INDIRECT) * BLOCK_SIZE) != 0) {
+		fail("%s", "out of memory");
+		return NULL;
+	}
+
+	int i;
+	while ((i = __sync_fetch_and_add(&next_work, 1)) < num_nodes && !failed) {
+		/* same initial state as inode_init() */
+		inode_t *inode = &inodes[i];
+		inode->ino = i;
+		inode->valid = 1;
+		inode->type = nodes[i].type;
+		for (int p=0; p < NUM_DIRECT; p++) {
+			inode->direct_ptr[p] = -1;
+		}
+		for (int k=0; k < NUM_INDIRECT; k++) {
+			inode->indirect_ptr[k] = -1;
+		}
+
+		if (nodes[i].type == TYPE_DIR)
+			write_dir(i, inode);
+		else
+			write_file(i, inode, buf);
+	}
+	free(buf);
+	return NULL;
+}
+
+
+/************** Main **************/
+
+/*
+ * Splits the ':'-separated DISKFILE argument into targets and names a
+ * temporary next to each one. Returns the ':'-joined temporaries in tmp_path,
+ * or -1 if there are too many files or a name is too long.
+ */
+static int name_temps(const char *diskfile_path, char *tmp_path) {
+	char paths[PATH_MAX], *save = NULL;
+	strncpy(paths, diskfile_path, PATH_MAX-1);
+	paths[PATH_MAX-1] = 0;
+	tmp_path[0] = 0;
+	for (char *p = strtok_r(paths, ":", &save); p != NULL; p = strtok_r(NULL, ":", &save)) {
+		if (num_targets == MAX_TARGETS) {
+			fprintf(stderr, "mktfs: at most %d backing files\n", MAX_TARGETS);
+			return -1;
+		}
+		strcpy(targets[num_targets], p);
+		if (snprintf(temps[num_targets], PATH_MAX, "%s.mktfs", p) >= PATH_MAX ||
+			strlen(tmp_path) + strlen(temps[num_targets]) + 2 > PATH_MAX) {
+			fprintf(stderr, "mktfs: %s: name too long\n", p);
+			return -1;
+		}
+		if (num_targets > 0)
+			strcat(tmp_path, ":");
+		strcat(tmp_path, temps[num_targets++]);
+	}
+	return num_targets > 0 ? 0 : -1;
+}
+
+
+static void remove_temps() {
+	for (int t=0; t < num_targets; t++) {
+		unlink(temps[t]);
+	}
+}
+
+
+static void usage(const char *prog) {
+	fprintf(stderr, "usage: %s [-d dir] [-j threads] [-s stripe_unit] DISKFILE[:DISKFILE...]\n", prog);
+	exit(1);
+}
+
+
+int main(int argc, char **argv) {
+	int opt, stripe_unit = 16;
+	const char *src = NULL;
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "d:j:s:")) != -1) {
+		switch (opt) {
+		case 'd': src = optarg; break;
+		case 'j': nthreads = atoi(optarg); break;
+		case 's': stripe_unit = atoi(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind != argc-1)
+		usage(argv[0]);
+	nthreads = MAX(nthreads, 1);
+
+	/* Scan the host tree, the root directory is inode 0 */
+	nodes[ROOT_INO].path = strdup(src != NULL ? src : "");
+	nodes[ROOT_INO].name = "";
+	nodes[ROOT_INO].type = TYPE_DIR;
+	num_nodes = 1;
+	if (src != NULL) {
+		struct stat st;
+		if (stat(src, &st) < 0 || !S_ISDIR(st.st_mode)) {
+			fprintf(stderr, "mktfs: %s is not a directory\n", src);
+			return 1;
+		}
+		queue_push(ROOT_INO);
+		run_threads(scan_main);
+	}
+	if (failed)
+		return 1;
+
+	/*
+	 * Place everything before touching the disks. The image is built in
+	 * empty temporaries, so nothing stale survives, and they replace the
+	 * targets only once it is complete; on any error the old image stays.
+	 */
+	char tmp_path[PATH_MAX];
+	if (name_temps(argv[optind], tmp_path) < 0)
+		usage(argv[0]);
+	sb_layout(&superblock, num_targets, stripe_unit);
+	int used = layout();
+	if (used < 0)
+		return 1;
+	int inode_blks = (MAX_INUM + INODE_PER_BLK-1) / INODE_PER_BLK;
+	inodes = calloc(inode_blks * INODE_PER_BLK, sizeof(inode_t));
+	if (inodes == NULL) {
+		fail("%s", "out of memory");
+		return 1;
+	}
+
+	remove_temps();
+	dev_init(tmp_path, 0);
+	dev_set_stripe(stripe_unit);
+	dev_csum_init(superblock.c_start_blk, superblock.c_num_blk, 0);
+	run_threads(write_main);
+	if (failed) {
+		dev_close();
+		remove_temps();
+		return 1;
+	}
+
+	/* Inode table, bitmaps and the rest of the metadata, each written once */
+	char *block = calloc(MAX(inode_blks, superblock.r_num_blk), BLOCK_SIZE);
+	if (block == NULL) {
+		dev_close();
+		remove_temps();
+		fail("%s", "out of memory");
+		return 1;
+	}
+	for (int b=0; b < inode_blks; b++) {
+		memcpy(block + b*BLOCK_SIZE, inodes + b*INODE_PER_BLK, INODE_PER_BLK * sizeof(inode_t));
+	}
+	bio_writev(superblock.i_start_blk, inode_blks, block);
+
+	memset(block, 0, BLOCK_SIZE);
+	for (int i=0; i < num_nodes; i++) {
+		set_bitmap(block, i);
+	}
+	bio_write(superblock.i_bitmap_blk, block);
+	memset(block, 0, BLOCK_SIZE);
+	for (int i=0; i < used; i++) {
+		set_bitmap(block, i);
+	}
+	bio_write(superblock.d_bitmap_blk, block);
+
+	memset(block, 0, (size_t)superblock.r_num_blk * BLOCK_SIZE);
+	bio_write(superblock.o_bitmap_blk, block);
+	bio_writev(superblock.r_start_blk, superblock.r_num_blk, block);
+
+	superblock.free_inum = MAX_INUM - num_nodes;
+	superblock.free_dnum = MAX_DNUM - used;
+	memset(block, 0, BLOCK_SIZE);
+	memcpy(block, &superblock, sizeof(superblock_t));
+	bio_write(0, block);
+	dev_close();
+
+	for (int t=0; t < num_targets; t++) {
+		if (rename(temps[t], targets[t]) < 0) {
+			fail("cannot replace %s", targets[t]);
+			remove_temps();
+			return 1;
+		}
+	}
+	/* a checkpoint journal of the replaced image must not be replayed onto this one */
+	char ckpt[PATH_MAX + 8];
+	snprintf(ckpt, sizeof(ckpt), "%s.ckpt", targets[0]);
+	unlink(ckpt);
+
+	printf("%s: %d inodes, %d data blocks\n", argv[optind], num_nodes, used);
+	free(block);
+	free(inodes);
+	return 0;
+}
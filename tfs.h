@@ -7,6 +7,7 @@
  */
 
 #include <sys/stat.h>
+#include <sys/ioctl.h>
 #include <unistd.h>
 #include <stdint.h>
 
@@ -17,6 +18,66 @@
 #define MAX_INUM 1024
 #define MAX_DNUM 16384
 
+/* Block pointers per inode and per indirect block */
+#define NUM_DIRECT		16
+#define NUM_INDIRECT	8
+#define PTRS_PER_BLK	(BLOCK_SIZE/sizeof(int))
+#define MAX_FILE_BLKS	(NUM_DIRECT + NUM_INDIRECT*PTRS_PER_BLK)
+
+/* 
+ * Block pointer values. PTR_NONE is a hole. Preallocated blocks that have
+ * never been written are stored as UNWRITTEN(blkno), which is always < -1;
+ * applying UNWRITTEN() again gives back blkno.
+ */
+#define PTR_NONE		-1
+#define UNWRITTEN(p)	(-(p) - 2)
+
+/* 
+ * Refcount region, one entry per data block counting references beyond the
+ * first. Blocks shared by clones have a nonzero entry.
+ */
+#define REFS_PER_BLK	(BLOCK_SIZE/sizeof(uint16_t))
+#define REF_MAX			UINT16_MAX
+
+/* 
+ * TFS_IOC_CLONE on an open file makes dest a copy-on-write clone of it; on a
+ * directory it snapshots the whole tree into dest. dest is a path from the
+ * root of the mount and must not exist yet.
+ */
+struct tfs_clone_arg {
+	char dest[256];
+};
+#define TFS_IOC_CLONE	_IOW('T', 1, struct tfs_clone_arg)
+
+/* 
+ * TFS_IOC_DEFRAG on an open file moves its data blocks into one contiguous
+ * run. On a directory it does so for every file below it, and also slides
+ * files that are already contiguous towards the start of the data region so
+ * free space ends up in few large runs. Counts are returned in the arg.
+ */
+struct tfs_defrag_arg {
+	uint32_t files;				/* files looked at */
+	uint32_t moved;				/* files relocated */
+	uint32_t blocks;			/* data blocks relocated */
+	uint32_t extents_before;	/* extents over all files looked at */
+	uint32_t extents_after;
+	uint32_t free_runs_before;	/* runs of free blocks in the data region */
+	uint32_t free_runs_after;
+};
+#define TFS_IOC_DEFRAG	_IOWR('T', 2, struct tfs_defrag_arg)
+
+/* 
+ * Fragmentation score of a file with blocks data blocks in extents runs of
+ * adjacent blocks: 0 when contiguous, 100 when no two blocks are adjacent.
+ */
+static inline int frag_score(int extents, int blocks) {
+	return (blocks > 1) ? 100 * (extents - 1) / (blocks - 1) : 0;
+}
+
+#define ROOT_INO 	0
+#define TYPE_DIR 	0
+#define TYPE_FILE 	1
+
 
 typedef struct superblock_t {
 	uint32_t	magic_num;			/* magic number */
@@ -26,6 +87,16 @@ typedef struct superblock_t {
 	uint32_t	d_bitmap_blk;		/* start block of data block bitmap */
 	uint32_t	i_start_blk;		/* start block of inode region */
 	uint32_t	d_start_blk;		/* start block of data block region */
+	uint32_t	c_start_blk;		/* start block of checksum region */
+	uint32_t	c_num_blk;			/* number of blocks in checksum region */
+	uint32_t	o_bitmap_blk;		/* orphan inode bitmap, 0 if none */
+	uint32_t	free_inum;			/* free inodes, saved at unmount */
+	uint32_t	free_dnum;			/* free data blocks, saved at unmount */
+	uint32_t	r_start_blk;		/* start block of refcount region, 0 if none */
+	uint32_t	r_num_blk;			/* number of blocks in refcount region */
+	uint32_t	s_num_disks;		/* backing files striped over, 0 before striping */
+	uint32_t	s_stripe_unit;		/* blocks per stripe */
+	uint32_t	c_dirty;			/* mounted, checksum region may lag the data */
 } superblock_t;
 
 typedef struct inode_t {
@@ -50,6 +121,39 @@ typedef struct dirent_t {
 } dirent_t;
 
 
+/* 
+ * Lays out the regions of a new image in sb: bitmaps and inode table, the
+ * data region, then the checksum, orphan and refcount regions. Everything
+ * starts out free. Shared by tfs_mkfs() and mktfs so both write one format.
+ */
+static inline void sb_layout(superblock_t *sb, int num_disks, int stripe_unit) {
+	int inode_per_blk = BLOCK_SIZE / sizeof(inode_t);
+
+	*sb = (superblock_t){ 0 };
+	sb->magic_num = MAGIC_NUM;
+	sb->max_inum = MAX_INUM;
+	sb->max_dnum = MAX_DNUM;
+	sb->i_bitmap_blk = 1;
+	sb->d_bitmap_blk = 2;
+	sb->i_start_blk = sb->d_bitmap_blk+1;
+	sb->d_start_blk = sb->i_start_blk + (MAX_INUM+(inode_per_blk-1))/inode_per_blk;
+
+	/* Checksum region sits after the data region and covers every block before it */
+	sb->c_start_blk = sb->d_start_blk + MAX_DNUM;
+	sb->c_num_blk = (sb->c_start_blk + (CSUM_PER_BLOCK-1)) / CSUM_PER_BLOCK;
+
+	/* Orphan inode bitmap follows the checksum region, then the refcounts */
+	sb->o_bitmap_blk = sb->c_start_blk + sb->c_num_blk;
+	sb->r_start_blk = sb->o_bitmap_blk + 1;
+	sb->r_num_blk = (MAX_DNUM + (REFS_PER_BLK-1)) / REFS_PER_BLK;
+
+	sb->free_inum = MAX_INUM;
+	sb->free_dnum = MAX_DNUM;
+	sb->s_num_disks = num_disks;
+	sb->s_stripe_unit = (stripe_unit > 0) ? stripe_unit : 1;
+}
+
+
 /*
  * bitmap operations
  */
@@ -0,0 +1,97 @@
+/*
+ *  Copyright (C) 2021 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	tfs_bench.c
+ *
+ *	Measures sequential write and read throughput of a mounted tfs at 4KB,
+ *	128KB and 1MB request sizes. Each size writes a scratch file under DIR
+ *	with requests of that size, drops it from the page cache and reads it
+ *	back the same way, so the reads reach tfs as well.
+ *
+ *	To see what big writes buy, run it on a mount with the default options
+ *	and again on one mounted with -o max_write=4096,max_read=4096, where
+ *	the kernel hands tfs every request as 4KB pieces as if big_writes were
+ *	off. Use the same DISKFILE location for both runs.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+
+static const int req_sizes[] = { 4 << 10, 128 << 10, 1 << 20 };
+
+
+static void usage(const char *prog) {
+	fprintf(stderr, "usage: %s [-m MB] DIR\n", prog);
+	fprintf(stderr, "  -m  size of the scratch file in MB, default 16\n");
+	exit(1);
+}
+
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* Writes or reads total bytes of fd in req sized requests, returns MB/s or -1 */
+static double run(int fd, char *buf, size_t req, size_t total, int write) {
+	double start = now();
+	for (size_t off = 0; off < total; off += req) {
+		ssize_t n = write ? pwrite(fd, buf, req, off) : pread(fd, buf, req, off);
+		if (n != (ssize_t)req)
+			return -1;
+	}
+	if (write && fsync(fd) < 0)
+		return -1;
+	double elapsed = now() - start;
+	return total / 1048576.0 / elapsed;
+}
+
+
+int main(int argc, char **argv) {
+	size_t total = 16 << 20;
+	int opt;
+	while ((opt = getopt(argc, argv, "m:")) != -1) {
+		switch (opt) {
+		case 'm': total = (size_t)atoi(optarg) << 20; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind != argc-1 || total == 0)
+		usage(argv[0]);
+
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/.tfs_bench", argv[optind]);
+	char *buf = malloc(1 << 20);
+	for (int i = 0; i < 1 << 20; i++)
+		buf[i] = rand();
+
+	printf("%10s %12s %12s\n", "request", "write MB/s", "read MB/s");
+	for (int s = 0; s < (int)(sizeof(req_sizes) / sizeof(req_sizes[0])); s++) {
+		size_t req = req_sizes[s];
+		int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			perror(path);
+			return 1;
+		}
+		double w = run(fd, buf, req, total, 1);
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		double r = (w < 0) ? -1 : run(fd, buf, req, total, 0);
+		close(fd);
+		unlink(path);
+		if (w < 0 || r < 0) {
+			perror(path);
+			return 1;
+		}
+		printf("%8zuKB %12.1f %12.1f\n", req >> 10, w, r);
+	}
+	free(buf);
+	return 0;
+}
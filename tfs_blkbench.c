@@ -0,0 +1,154 @@
+/*
+ *  Copyright (C) 2021 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	tfs_blkbench.c
+ *
+ *	Measures what block checksums cost at the block layer. Creates a fresh
+ *	image at DISKFILE, overwriting it only with -F, and runs the same three workloads with checksums off,
+ *	with checksums kept, and with checksums kept and verified on read:
+ *	random 4KB bio_write, sequential 64KB bio_writev and random 4KB bio_read.
+ *	Write timings include writing the checksum region back at the end.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+
+#include "block.h"
+#include "tfs.h"
+
+#define VEC_BLOCKS 16
+
+enum { W_WRITE, W_WRITEV, W_READ, NUM_WORKLOADS };
+static const char *workload_names[NUM_WORKLOADS] = { "4KB write", "64KB writev", "4KB read" };
+static const char *mode_names[] = { "off", "on", "verify" };
+
+
+static void usage(const char *prog) {
+	fprintf(stderr, "usage: %s [-dF] [-m MB] [-r ROUNDS] DISKFILE[:DISKFILE...]\n", prog);
+	fprintf(stderr, "  DISKFILE is reformatted, its contents are lost\n");
+	fprintf(stderr, "  -d  open DISKFILE with O_DIRECT, timing the device instead of the page cache\n");
+	fprintf(stderr, "  -F  overwrite DISKFILE if it exists\n");
+	fprintf(stderr, "  -m  data moved per workload and round in MB, default 32\n");
+	fprintf(stderr, "  -r  rounds, the best one is reported, default 5\n");
+	exit(1);
+}
+
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* Returns the first of the colon-separated files in paths that exists */
+static const char *existing(const char *paths) {
+	static char path[PATH_MAX];
+	while (*paths != 0) {
+		size_t len = strcspn(paths, ":");
+		snprintf(path, sizeof(path), "%.*s", (int)len, paths);
+		if (len > 0 && access(path, F_OK) == 0)
+			return path;
+		paths += len + (paths[len] == ':');
+	}
+	return NULL;
+}
+
+
+/* Runs one workload over the data region of sb, returns MB/s */
+static double run(const superblock_t *sb, int workload, int nblocks, char *buf) {
+	int span = sb->max_dnum - VEC_BLOCKS;
+	unsigned seed = 1;
+	double start = now();
+	switch (workload) {
+	case W_WRITE:
+		for (int n = 0; n < nblocks; n++)
+			bio_write(sb->d_start_blk + rand_r(&seed) % span, buf);
+		dev_csum_sync();
+		break;
+	case W_WRITEV:
+		for (int n = 0; n < nblocks; n += VEC_BLOCKS)
+			bio_writev(sb->d_start_blk + n % span, VEC_BLOCKS, buf);
+		dev_csum_sync();
+		break;
+	case W_READ:
+		for (int n = 0; n < nblocks; n++)
+			bio_read(sb->d_start_blk + rand_r(&seed) % span, buf);
+		break;
+	}
+	return (double)nblocks * BLOCK_SIZE / 1048576.0 / (now() - start);
+}
+
+
+int main(int argc, char **argv) {
+	int mb = 32, rounds = 5, flags = 0, force = 0, opt;
+	while ((opt = getopt(argc, argv, "dFm:r:")) != -1) {
+		switch (opt) {
+		case 'd': flags = DEV_DIRECT; break;
+		case 'F': force = 1; break;
+		case 'm': mb = atoi(optarg); break;
+		case 'r': rounds = atoi(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind != argc-1 || mb <= 0 || rounds <= 0)
+		usage(argv[0]);
+	int nblocks = mb * (1048576 / BLOCK_SIZE);
+	const char *path = existing(argv[optind]);
+	if (path != NULL && !force) {
+		fprintf(stderr, "%s: %s exists, use -F to overwrite it\n", argv[0], path);
+		return 1;
+	}
+
+	dev_init(argv[optind], flags);
+	dev_set_stripe(16);
+	superblock_t sb;
+	sb_layout(&sb, dev_num_disks(), 16);
+
+	char *buf = bio_buf_alloc();
+	char *vec;
+	if (posix_memalign((void**)&vec, BLOCK_SIZE, VEC_BLOCKS * BLOCK_SIZE) != 0)
+		return 1;
+	for (int i = 0; i < VEC_BLOCKS * BLOCK_SIZE; i++)
+		vec[i] = rand();
+	memcpy(buf, vec, BLOCK_SIZE);
+
+	/* Fill the data region once so reads do not hit holes */
+	for (int b = 0; b + VEC_BLOCKS <= sb.max_dnum; b += VEC_BLOCKS)
+		bio_writev(sb.d_start_blk + b, VEC_BLOCKS, vec);
+
+	double best[3][NUM_WORKLOADS] = {{0}};
+	for (int r = 0; r < rounds; r++) {
+		for (int mode = 0; mode < 3; mode++) {
+			dev_csum_init(sb.c_start_blk, mode == 0 ? 0 : sb.c_num_blk, mode == 2);
+			for (int w = 0; w < NUM_WORKLOADS; w++) {
+				double mbs = run(&sb, w, nblocks, w == W_WRITEV ? vec : buf);
+				if (mbs > best[mode][w])
+					best[mode][w] = mbs;
+			}
+		}
+	}
+
+	printf("%-12s", "checksums");
+	for (int w = 0; w < NUM_WORKLOADS; w++)
+		printf(" %20s", workload_names[w]);
+	printf("\n");
+	for (int mode = 0; mode < 3; mode++) {
+		printf("%-12s", mode_names[mode]);
+		for (int w = 0; w < NUM_WORKLOADS; w++) {
+			double overhead = 100.0 * (1 - best[mode][w] / best[0][w]);
+			printf(" %9.0f MB/s %+5.1f%%", best[mode][w], -overhead);
+		}
+		printf("\n");
+	}
+
+	bio_buf_free(buf);
+	free(vec);
+	dev_close();
+	return 0;
+}
@@ -0,0 +1,46 @@
+/*
+ *  Copyright (C) 2021 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	tfs_defrag.c
+ *
+ *	Defragments a file, or every file below a directory, on a mounted tfs
+ *	through TFS_IOC_DEFRAG and prints how the fragmentation changed.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "block.h"
+#include "tfs.h"
+
+
+int main(int argc, char **argv) {
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s PATH\n", argv[0]);
+		return 1;
+	}
+
+	int fd = open(argv[1], O_RDONLY);
+	if (fd < 0) {
+		perror(argv[1]);
+		return 1;
+	}
+	struct tfs_defrag_arg arg;
+	memset(&arg, 0, sizeof(arg));
+	if (ioctl(fd, TFS_IOC_DEFRAG, &arg) < 0) {
+		perror("TFS_IOC_DEFRAG");
+		close(fd);
+		return 1;
+	}
+	close(fd);
+
+	printf("%u files, %u moved (%u blocks)\n", arg.files, arg.moved, arg.blocks);
+	printf("extents: %u -> %u\n", arg.extents_before, arg.extents_after);
+	printf("free extents: %u -> %u\n", arg.free_runs_before, arg.free_runs_after);
+	return 0;
+}
@@ -0,0 +1,566 @@
+/*
+ *  Copyright (C) 2021 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	tfs_fsck.c
+ *
+ *	Offline consistency checker. Scans the inode table and every directory
+ *	block in parallel, rebuilds the inode and data bitmaps from what is
+ *	actually referenced and reports (or with -r repairs) any differences.
+ *	With -f it also reports how fragmented each file is.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "block.h"
+#include "tfs.h"
+
+#define MAX(x, y) (((x) > (y)) ? (x) : (y))
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+
+#define INODE_PER_BLK	(BLOCK_SIZE / sizeof(inode_t))
+#define DIRENT_PER_BLK	(BLOCK_SIZE / sizeof(dirent_t))
+
+/* Exit codes, same meaning as e2fsck */
+#define FSCK_OK			0
+#define FSCK_FIXED		1
+#define FSCK_UNFIXED	4
+#define FSCK_ERROR		8
+
+
+/* A block pointer that points to a block already owned by another inode */
+typedef struct dup_t {
+	uint16_t ino;
+	int slot;  /* file block index, or -1-k for indirect block k */
+	int blkno;
+} dup_t;
+
+
+/************** Static Variables **************/
+
+static superblock_t superblock;
+static bool repair;
+static bool frag_report;
+static int nthreads;
+
+static inode_t *inodes;		/* in-memory copy of the inode table */
+static uint16_t *blk_refs;	/* references to each data block */
+static uint16_t *ino_refs;	/* dirents (besides "." and "..") pointing to each inode */
+static char i_bitmap[BLOCK_SIZE], d_bitmap[BLOCK_SIZE];
+static char i_rebuilt[BLOCK_SIZE], d_rebuilt[BLOCK_SIZE];
+static char o_bitmap[BLOCK_SIZE], o_rebuilt[BLOCK_SIZE];	/* orphan list */
+static uint16_t *refcnt;	/* refcount region, extra references per block */
+
+static dup_t *dups;
+static int num_dups, cap_dups;
+static int num_dangling, num_badptr, num_ioerr;  /* num_ioerr counts bad checksums */
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static volatile int next_work;	/* shared work index for the scan threads */
+static int dir_inos[MAX_INUM], num_dirs;
+static bool inodes_dirty[MAX_INUM];
+static int file_blocks[MAX_INUM], file_extents[MAX_INUM];	/* for -f */
+
+
+/************** Helpers **************/
+
+/*
+ * A block that fails its checksum is still scanned as-is. When repairing it
+ * is written back so the checksum matches what fsck decided to keep.
+ */
+static void report_ioerr(int block_num, const char *block) {
+	pthread_mutex_lock(&report_lock);
+	printf("block %d: bad checksum\n", block_num);
+	num_ioerr++;
+	pthread_mutex_unlock(&report_lock);
+	if (repair)
+		bio_write(block_num, block);
+}
+
+
+static void record_dup(uint16_t ino, int slot, int blkno) {
+	pthread_mutex_lock(&report_lock);
+	if (num_dups == cap_dups) {
+		cap_dups = cap_dups ? cap_dups*2 : 64;
+		dups = realloc(dups, cap_dups * sizeof(dup_t));
+	}
+	dups[num_dups].ino = ino;
+	dups[num_dups].slot = slot;
+	dups[num_dups].blkno = blkno;
+	num_dups++;
+	pthread_mutex_unlock(&report_lock);
+}
+
+
+static bool is_data_blk(int blkno) {
+	return blkno >= (int)superblock.d_start_blk && blkno < (int)(superblock.d_start_blk + superblock.max_dnum);
+}
+
+
+/*
+ * Collects every block inode references into blks: data blocks (unwritten
+ * ones decoded) and, for files, the indirect blocks themselves. slots[n] is
+ * the file block index of blks[n], or -1-k for indirect block k. Pointers
+ * outside the data region are reported and skipped. Returns the count.
+ */
+static int inode_blocks(inode_t *inode, int *blks, int *slots, bool report) {
+	int count = 0;
+	int ptrs[PTRS_PER_BLK];
+
+	for (int i=0; i < MAX_FILE_BLKS; i++) {
+		int blkno;
+		if (i < NUM_DIRECT) {
+			blkno = inode->direct_ptr[i];
+		}
+		else {
+			int k = (i - NUM_DIRECT) / PTRS_PER_BLK;
+			int j = (i - NUM_DIRECT) % PTRS_PER_BLK;
+			if (inode->type != TYPE_FILE || inode->indirect_ptr[k] == -1) {
+				i += PTRS_PER_BLK - 1 - j;  /* skip whole indirect block */
+				continue;
+			}
+			if (j == 0) {
+				if (!is_data_blk(inode->indirect_ptr[k])) {
+					if (report) {
+						pthread_mutex_lock(&report_lock);
+						printf("inode %d: indirect_ptr[%d] = %d is outside data region\n", inode->ino, k, inode->indirect_ptr[k]);
+						num_badptr++;
+						pthread_mutex_unlock(&report_lock);
+					}
+					i += PTRS_PER_BLK - 1;
+					continue;
+				}
+				if (bio_read(inode->indirect_ptr[k], ptrs) < 0)
+					report_ioerr(inode->indirect_ptr[k], (char*)ptrs);
+				blks[count] = inode->indirect_ptr[k];
+				slots[count++] = -1-k;
+			}
+			blkno = ptrs[j];
+		}
+
+		if (blkno == PTR_NONE)
+			continue;
+		if (blkno < -1)
+			blkno = UNWRITTEN(blkno);
+		if (!is_data_blk(blkno)) {
+			if (report) {
+				pthread_mutex_lock(&report_lock);
+				printf("inode %d: block %d = %d is outside data region\n", inode->ino, i, blkno);
+				num_badptr++;
+				pthread_mutex_unlock(&report_lock);
+			}
+			continue;
+		}
+		blks[count] = blkno;
+		slots[count++] = i;
+	}
+	return count;
+}
+
+
+static void run_threads(void *(*fn)(void *)) {
+	pthread_t threads[nthreads];
+	next_work = 0;
+	for (int i=0; i < nthreads; i++) {
+		pthread_create(&threads[i], NULL, fn, NULL);
+	}
+	for (int i=0; i < nthreads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+}
+
+
+/************** Scan Phases **************/
+
+/*
+ * Phase 1: each thread claims inode table blocks, copies them into inodes[]
+ * and counts references to every data block from valid inodes.
+ */
+static void *scan_inodes(void *arg) {
+	int inode_blks = (superblock.max_inum + INODE_PER_BLK-1) / INODE_PER_BLK;
+	char block[BLOCK_SIZE];
+	int *blks = malloc((MAX_FILE_BLKS + NUM_INDIRECT) * sizeof(int));
+	int *slots = malloc((MAX_FILE_BLKS + NUM_INDIRECT) * sizeof(int));
+
+	int b;
+	while ((b = __sync_fetch_and_add(&next_work, 1)) < inode_blks) {
+		if (bio_read(superblock.i_start_blk + b, block) < 0)
+			report_ioerr(superblock.i_start_blk + b, block);
+		memcpy(inodes + b*INODE_PER_BLK, block, BLOCK_SIZE - BLOCK_SIZE % sizeof(inode_t));
+
+		for (int j=0; j < INODE_PER_BLK && b*INODE_PER_BLK+j < superblock.max_inum; j++) {
+			inode_t *inode = inodes + b*INODE_PER_BLK + j;
+			if (inode->valid != 1)
+				continue;
+
+			int count = inode_blocks(inode, blks, slots, true);
+			int prev = -2;
+			for (int n=0; n < count; n++) {
+				if (__sync_fetch_and_add(&blk_refs[blks[n] - superblock.d_start_blk], 1) > 0)
+					record_dup(inode->ino, slots[n], blks[n]);
+				if (inode->type != TYPE_FILE || slots[n] < 0)
+					continue;
+				file_blocks[inode->ino]++;
+				if (blks[n] != prev+1)
+					file_extents[inode->ino]++;
+				prev = blks[n];
+			}
+		}
+	}
+	free(blks);
+	free(slots);
+	return NULL;
+}
+
+
+/*
+ * Phase 2: each thread claims directories, reads their dirent blocks and
+ * counts links to each inode. Dangling dirents are cleared in place when
+ * repairing.
+ */
+static void *scan_dirs(void *arg) {
+	char block[BLOCK_SIZE];
+
+	int d;
+	while ((d = __sync_fetch_and_add(&next_work, 1)) < num_dirs) {
+		inode_t *dir = inodes + dir_inos[d];
+		for (int i=0; i < 16; i++) {
+			if (dir->direct_ptr[i] == -1 || !is_data_blk(dir->direct_ptr[i]))
+				continue;
+			if (bio_read(dir->direct_ptr[i], block) < 0)
+				report_ioerr(dir->direct_ptr[i], block);
+
+			bool changed = false;
+			for (int j=0; j < DIRENT_PER_BLK; j++) {
+				dirent_t *dirent = (dirent_t*)block+j;
+				if (dirent->valid != 1)
+					continue;
+
+				if (dirent->ino >= superblock.max_inum || inodes[dirent->ino].valid != 1) {
+					pthread_mutex_lock(&report_lock);
+					printf("dir %d: entry \"%.*s\" points to free inode %d\n", dir->ino,
+						MIN(dirent->name_len, 207), dirent->name, dirent->ino);
+					num_dangling++;
+					pthread_mutex_unlock(&report_lock);
+					if (repair) {
+						dirent->valid = 0;
+						changed = true;
+					}
+					continue;
+				}
+				if (strcmp(dirent->name, ".") != 0 && strcmp(dirent->name, "..") != 0)
+					__sync_fetch_and_add(&ino_refs[dirent->ino], 1);
+			}
+			if (changed)
+				bio_write(dir->direct_ptr[i], block);
+		}
+	}
+	return NULL;
+}
+
+
+/************** Repair **************/
+
+/*
+ * Drops an unreachable inode and the references it held so that its blocks
+ * are left out of the rebuilt bitmap.
+ */
+static void free_orphan(inode_t *inode) {
+	static int blks[MAX_FILE_BLKS + NUM_INDIRECT], slots[MAX_FILE_BLKS + NUM_INDIRECT];
+	int count = inode_blocks(inode, blks, slots, false);
+	for (int n=0; n < count; n++) {
+		blk_refs[blks[n] - superblock.d_start_blk]--;
+	}
+	inode->valid = 0;
+	inodes_dirty[inode->ino] = true;
+}
+
+
+/*
+ * Points slot of inode (see inode_blocks()) at blkno, keeping an unwritten
+ * pointer unwritten.
+ */
+static void set_slot(inode_t *inode, int slot, int blkno) {
+	if (slot < 0) {
+		inode->indirect_ptr[-1-slot] = blkno;
+		inodes_dirty[inode->ino] = true;
+	}
+	else if (slot < NUM_DIRECT) {
+		inode->direct_ptr[slot] = (inode->direct_ptr[slot] < -1) ? UNWRITTEN(blkno) : blkno;
+		inodes_dirty[inode->ino] = true;
+	}
+	else {
+		int ptrs[PTRS_PER_BLK];
+		int ind = inode->indirect_ptr[(slot - NUM_DIRECT) / PTRS_PER_BLK];
+		int j = (slot - NUM_DIRECT) % PTRS_PER_BLK;
+		bio_read(ind, ptrs);
+		ptrs[j] = (ptrs[j] < -1) ? UNWRITTEN(blkno) : blkno;
+		bio_write(ind, ptrs);
+	}
+}
+
+
+/*
+ * Gives each extra owner of a doubly-allocated block its own copy, using
+ * free blocks from the rebuilt bitmap.
+ */
+static int fix_dups() {
+	int unfixed = 0;
+	char block[BLOCK_SIZE];
+	for (int k=0; k < num_dups; k++) {
+		inode_t *inode = inodes + dups[k].ino;
+		if (inode->valid != 1)
+			continue;  /* owner was dropped as an orphan */
+
+		int old = dups[k].blkno;
+		int idx = 0;
+		while (idx < superblock.max_dnum && get_bitmap(d_rebuilt, idx))
+			idx++;
+		if (idx == superblock.max_dnum) {
+			printf("inode %d: no free block to split shared block %d\n", inode->ino, old);
+			unfixed++;
+			continue;
+		}
+		set_bitmap(d_rebuilt, idx);
+		bio_read(old, block);
+		bio_write(superblock.d_start_blk + idx, block);
+		set_slot(inode, dups[k].slot, superblock.d_start_blk + idx);
+	}
+	return unfixed;
+}
+
+
+static void write_inodes() {
+	char block[BLOCK_SIZE];
+	int inode_blks = (superblock.max_inum + INODE_PER_BLK-1) / INODE_PER_BLK;
+	for (int b=0; b < inode_blks; b++) {
+		bool dirty = false;
+		for (int j=0; j < INODE_PER_BLK && b*INODE_PER_BLK+j < superblock.max_inum; j++)
+			dirty |= inodes_dirty[b*INODE_PER_BLK+j];
+		if (!dirty)
+			continue;
+		bio_read(superblock.i_start_blk + b, block);
+		memcpy(block, inodes + b*INODE_PER_BLK, BLOCK_SIZE - BLOCK_SIZE % sizeof(inode_t));
+		bio_write(superblock.i_start_blk + b, block);
+	}
+}
+
+
+/************** Main **************/
+
+static void usage(const char *prog) {
+	fprintf(stderr, "usage: %s [-r] [-f] [-j threads] DISKFILE[:DISKFILE...]\n", prog);
+	exit(FSCK_ERROR);
+}
+
+
+int main(int argc, char **argv) {
+	int opt;
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "rfj:")) != -1) {
+		switch (opt) {
+		case 'r': repair = true; break;
+		case 'f': frag_report = true; break;
+		case 'j': nthreads = atoi(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind != argc-1)
+		usage(argv[0]);
+	nthreads = MAX(nthreads, 1);
+
+	/* Load superblock */
+	char block[BLOCK_SIZE];
+	if (dev_open(argv[optind], 0) < 0)
+		return FSCK_ERROR;
+	bio_read(0, block);
+	memcpy(&superblock, block, sizeof(superblock_t));
+	if (superblock.magic_num != MAGIC_NUM) {
+		fprintf(stderr, "%s: bad magic number, not a tfs image\n", argv[optind]);
+		return FSCK_ERROR;
+	}
+	if (MAX(superblock.s_num_disks, 1) != dev_num_disks()) {
+		fprintf(stderr, "%s: image was made with %d backing files, %d given\n", argv[optind],
+			MAX(superblock.s_num_disks, 1), dev_num_disks());
+		return FSCK_ERROR;
+	}
+	if (superblock.s_num_disks > 0)
+		dev_set_stripe(superblock.s_stripe_unit);
+	/* After a crash the checksum region lags the data, tfs redoes it at the next mount */
+	if (superblock.c_dirty)
+		printf("%s: not unmounted cleanly, checksums not verified\n", argv[optind]);
+	if (superblock.c_num_blk > 0)
+		dev_csum_init(superblock.c_start_blk, superblock.c_num_blk, !superblock.c_dirty);
+
+	/* Bitmaps are rebuilt from scratch, so a bad checksum here is repairable */
+	int bad_bitmaps = 0;
+	if (bio_read(superblock.i_bitmap_blk, i_bitmap) < 0)
+		bad_bitmaps++;
+	if (bio_read(superblock.d_bitmap_blk, d_bitmap) < 0)
+		bad_bitmaps++;
+	if (superblock.o_bitmap_blk != 0 && bio_read(superblock.o_bitmap_blk, o_bitmap) < 0)
+		bad_bitmaps++;
+
+	if (superblock.r_start_blk != 0) {
+		refcnt = calloc(superblock.r_num_blk, BLOCK_SIZE);
+		for (int b=0; b < superblock.r_num_blk; b++) {
+			if (bio_read(superblock.r_start_blk + b, (char*)refcnt + b*BLOCK_SIZE) < 0)
+				bad_bitmaps++;
+		}
+	}
+
+	inodes = calloc(superblock.max_inum + INODE_PER_BLK, sizeof(inode_t));
+	ino_refs = calloc(superblock.max_inum, sizeof(uint16_t));
+	blk_refs = calloc(superblock.max_dnum, sizeof(uint16_t));
+
+	/* Phase 1 and 2: parallel scans */
+	run_threads(scan_inodes);
+	for (int i=0; i < superblock.max_inum; i++) {
+		if (inodes[i].valid == 1 && inodes[i].type == TYPE_DIR)
+			dir_inos[num_dirs++] = i;
+	}
+	run_threads(scan_dirs);
+
+	/* 
+	 * Phase 3: orphans, then rebuild bitmaps from what is left. Unreferenced
+	 * inodes on the orphan list are waiting for the reclaimer and are fine,
+	 * any other bit on the list is stale.
+	 */
+	int num_orphans = 0, num_pending = 0, bad_obits = 0;
+	for (int i=0; i < superblock.max_inum; i++) {
+		bool listed = get_bitmap(o_bitmap, i);
+		bool unreferenced = i != ROOT_INO && inodes[i].valid == 1 && ino_refs[i] == 0;
+		if (listed && unreferenced) {
+			set_bitmap(o_rebuilt, i);
+			num_pending++;
+			continue;
+		}
+		if (listed) {
+			printf("orphan list: inode %d is %s\n", i, inodes[i].valid == 1 ? "in use" : "free");
+			bad_obits++;
+		}
+		if (!unreferenced)
+			continue;
+		printf("inode %d: not referenced by any directory\n", i);
+		num_orphans++;
+		if (repair)
+			free_orphan(&inodes[i]);
+	}
+
+	/* 
+	 * Data blocks with a nonzero refcount are meant to be shared by clones,
+	 * so their extra owners are not dups; the refcount just has to match.
+	 * Anything else shared is split by fix_dups().
+	 */
+	int bad_refs = 0, kept = 0;
+	for (int k=0; k < num_dups; k++) {
+		int idx = dups[k].blkno - superblock.d_start_blk;
+		if (refcnt == NULL || refcnt[idx] == 0 || dups[k].slot < 0)
+			dups[kept++] = dups[k];
+	}
+	num_dups = kept;
+	for (int i=0; refcnt != NULL && i < superblock.max_dnum; i++) {
+		if (refcnt[i] == 0)
+			continue;
+		int refs = MAX(blk_refs[i] - 1, 0);
+		for (int k=0; k < num_dups; k++) {
+			if (dups[k].blkno == superblock.d_start_blk + i)
+				refs--;  /* shared through an indirect block, will be split */
+		}
+		if (refcnt[i] != refs) {
+			printf("block %d: refcount %d, should be %d\n", superblock.d_start_blk+i, refcnt[i], refs);
+			refcnt[i] = refs;
+			bad_refs++;
+		}
+	}
+
+	int bad_ibits = 0, bad_dbits = 0, num_inodes = 0;
+	for (int i=0; i < superblock.max_inum; i++) {
+		if (inodes[i].valid == 1) {
+			set_bitmap(i_rebuilt, i);
+			num_inodes++;
+		}
+		if (get_bitmap(i_rebuilt, i) != get_bitmap(i_bitmap, i)) {
+			printf("inode bitmap: bit %d is %d, should be %d\n", i, get_bitmap(i_bitmap, i), get_bitmap(i_rebuilt, i));
+			bad_ibits++;
+		}
+	}
+	for (int i=0; i < superblock.max_dnum; i++) {
+		if (blk_refs[i] > 0)
+			set_bitmap(d_rebuilt, i);
+		if (get_bitmap(d_rebuilt, i) != get_bitmap(d_bitmap, i)) {
+			printf("data bitmap: block %d is %d, should be %d\n", superblock.d_start_blk+i,
+				get_bitmap(d_bitmap, i), get_bitmap(d_rebuilt, i));
+			bad_dbits++;
+		}
+	}
+	for (int k=0; k < num_dups; k++) {
+		printf("inode %d: block %d = %d is shared with another inode\n", dups[k].ino,
+			dups[k].slot, dups[k].blkno);
+	}
+
+	/* Fragmentation, scored per file as in tfs.h; informational only */
+	if (frag_report) {
+		int fragmented = 0, free_runs = 0, files = 0, score_sum = 0;
+		for (int i=0; i < superblock.max_inum; i++) {
+			if (inodes[i].valid != 1 || inodes[i].type != TYPE_FILE || file_blocks[i] == 0)
+				continue;
+			int score = frag_score(file_extents[i], file_blocks[i]);
+			files++;
+			score_sum += score;
+			if (score == 0)
+				continue;
+			printf("inode %d: %d blocks in %d extents, fragmentation %d\n", i, file_blocks[i],
+				file_extents[i], score);
+			fragmented++;
+		}
+		for (int i=0; i < superblock.max_dnum; i++) {
+			if (!get_bitmap(d_rebuilt, i) && (i == 0 || get_bitmap(d_rebuilt, i-1)))
+				free_runs++;
+		}
+		printf("%d of %d files fragmented, average fragmentation %d, %d free extents\n",
+			fragmented, files, files ? score_sum / files : 0, free_runs);
+	}
+
+	int errors = bad_bitmaps + num_orphans + bad_ibits + bad_dbits + bad_obits + bad_refs + num_dups + num_dangling + num_badptr + num_ioerr;
+	int unfixed = 0;
+	if (repair && errors > 0) {
+		unfixed += fix_dups();
+		write_inodes();
+		bio_write(superblock.i_bitmap_blk, i_rebuilt);
+		bio_write(superblock.d_bitmap_blk, d_rebuilt);
+		if (superblock.o_bitmap_blk != 0)
+			bio_write(superblock.o_bitmap_blk, o_rebuilt);
+		for (int b=0; refcnt != NULL && b < superblock.r_num_blk; b++) {
+			bio_write(superblock.r_start_blk + b, (char*)refcnt + b*BLOCK_SIZE);
+		}
+
+		/* keep the free counts in line with the rebuilt bitmaps */
+		superblock.free_inum = superblock.max_inum - num_inodes;
+		superblock.free_dnum = 0;
+		for (int i=0; i < superblock.max_dnum; i++) {
+			superblock.free_dnum += !get_bitmap(d_rebuilt, i);
+		}
+		memset(block, 0, BLOCK_SIZE);
+		memcpy(block, &superblock, sizeof(superblock_t));
+		bio_write(0, block);
+		unfixed += num_badptr;
+	}
+
+	printf("%s: %d inodes, %d dirs, %d orphans, %d pending reclaim, %d dangling dirents, "
+		"%d shared blocks, %d bad inode bits, %d bad block bits, %d bad orphan bits, "
+		"%d bad refcounts\n", argv[optind], num_inodes, num_dirs, num_orphans, num_pending,
+		num_dangling, num_dups, bad_ibits, bad_dbits, bad_obits, bad_refs);
+	dev_close();
+
+	if (errors == 0)
+		return FSCK_OK;
+	if (repair && unfixed == 0)
+		return FSCK_FIXED;
+	return FSCK_UNFIXED;
+}
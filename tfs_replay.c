@@ -0,0 +1,319 @@
+/*
+ *  Copyright (C) 2021 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	tfs_replay.c
+ *
+ *	Replays the block layer part of a trace recorded with -o trace=FILE
+ *	against an image. Each traced thread gets a replay thread, issuing its
+ *	ops at the recorded times or, with -f, back to back. Writes to blocks
+ *	holding file contents store a filler pattern, so replay against a copy
+ *	of the image. Every other block, directory and indirect blocks included,
+ *	is rewritten with what it holds, keeping the image mountable.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "block.h"
+#include "tfs.h"
+#include "trace.h"
+
+#define MAX(x, y) (((x) > (y)) ? (x) : (y))
+
+/* Per-op totals, one set per replay thread and merged at the end */
+typedef struct op_stats_t {
+	uint64_t	count;
+	uint64_t	recorded_ns;
+	uint64_t	replayed_ns;
+} op_stats_t;
+
+/* Records of one traced thread */
+typedef struct stream_t {
+	trace_rec_t	*recs;
+	int			num_recs;
+	op_stats_t	stats[TR_NUM_OPS];
+	pthread_t	thread;
+} stream_t;
+
+
+/************** Static Variables **************/
+
+static superblock_t superblock;
+static bool fast;			/* ignore recorded timing */
+static bool read_only;		/* skip writes and discards */
+static uint64_t start_ns;	/* replay epoch, matches ts 0 of the trace */
+static int max_blocks = 1;	/* largest readv/writev, sizes the buffers */
+static bitmap_t file_data;	/* blocks holding file contents, see classify() */
+
+
+static void usage(const char *prog) {
+	fprintf(stderr, "usage: %s [-f] [-r] TRACE DISKFILE[:DISKFILE...]\n", prog);
+	fprintf(stderr, "  -f  replay as fast as possible instead of at the recorded times\n");
+	fprintf(stderr, "  -r  replay reads only\n");
+	exit(1);
+}
+
+
+static int cmp_rec(const void *a, const void *b) {
+	const trace_rec_t *x = a, *y = b;
+	if (x->tid != y->tid)
+		return x->tid - y->tid;
+	return (x->ts > y->ts) - (x->ts < y->ts);
+}
+
+
+static void wait_until(uint64_t ns) {
+	struct timespec ts = { ns / 1000000000, ns % 1000000000 };
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+	}
+}
+
+
+/*
+ * Issues one block op. FUSE ops are not replayed, the block ops they
+ * caused are in the trace on their own. Returns false if skipped.
+ */
+static bool replay_one(const trace_rec_t *rec, char *buf) {
+	int count = MAX(rec->size / BLOCK_SIZE, 1);
+	switch (rec->op) {
+	case TR_BIO_READ:
+		bio_read(rec->arg, buf);
+		return true;
+	case TR_BIO_READV:
+		bio_readv(rec->arg, count, buf);
+		return true;
+	case TR_BIO_WRITE:
+		if (read_only)
+			return false;
+		bio_write(rec->arg, buf);
+		return true;
+	case TR_BIO_WRITEV:
+		if (read_only)
+			return false;
+		bio_writev(rec->arg, count, buf);
+		return true;
+	case TR_BIO_DISCARD:
+		if (read_only)
+			return false;
+		bio_discard(rec->arg, count);
+		return true;
+	default:
+		return false;
+	}
+}
+
+
+static void mark_file_data(int blkno) {
+	if (blkno < PTR_NONE)
+		blkno = UNWRITTEN(blkno);
+	if (blkno >= (int)superblock.d_start_blk && blkno < (int)superblock.c_start_blk)
+		set_bitmap(file_data, blkno);
+}
+
+
+static bool is_file_data(int blkno) {
+	return blkno >= 0 && blkno < (int)superblock.c_start_blk && get_bitmap(file_data, blkno);
+}
+
+
+/*
+ * Marks every block of the image that holds file contents in file_data by
+ * walking the valid file inodes and their indirect blocks. Directory blocks,
+ * indirect blocks and free blocks are left unmarked.
+ */
+static void classify() {
+	char block[BLOCK_SIZE];
+	int ptrs[PTRS_PER_BLK];
+	int inode_per_blk = BLOCK_SIZE / sizeof(inode_t);
+
+	file_data = calloc(superblock.c_start_blk / 8 + 1, 1);
+	for (uint32_t b = superblock.i_start_blk; b < superblock.d_start_blk; b++) {
+		bio_read(b, block);
+		for (int i = 0; i < inode_per_blk; i++) {
+			inode_t *inode = (inode_t*)block + i;
+			if (!inode->valid || inode->type != TYPE_FILE)
+				continue;
+			for (int k = 0; k < NUM_DIRECT; k++) {
+				mark_file_data(inode->direct_ptr[k]);
+			}
+			for (int k = 0; k < NUM_INDIRECT; k++) {
+				int ind = inode->indirect_ptr[k];
+				if (ind < (int)superblock.d_start_blk || ind >= (int)superblock.c_start_blk)
+					continue;
+				bio_read(ind, (char*)ptrs);
+				for (int j = 0; j < (int)PTRS_PER_BLK; j++) {
+					mark_file_data(ptrs[j]);
+				}
+			}
+		}
+	}
+}
+
+
+/*
+ * Fills buf for a write: file contents get the filler pattern and every
+ * other block is loaded with what it holds, so rewriting it changes nothing.
+ */
+static void prepare(const trace_rec_t *rec, char *buf) {
+	if (rec->op != TR_BIO_WRITE && rec->op != TR_BIO_WRITEV)
+		return;
+	int count = MAX(rec->size / BLOCK_SIZE, 1);
+	int n = 0;
+	while (n < count && is_file_data(rec->arg + n)) {
+		n++;
+	}
+	if (n < count)
+		bio_readv(rec->arg, count, buf);
+	for (n = 0; n < count; n++) {
+		if (is_file_data(rec->arg + n))
+			memset(buf + (size_t)n*BLOCK_SIZE, 0xa5, BLOCK_SIZE);
+	}
+}
+
+
+static void *replay_main(void *arg) {
+	stream_t *stream = arg;
+	char *buf;
+	if (posix_memalign((void**)&buf, BLOCK_SIZE, (size_t)max_blocks*BLOCK_SIZE) != 0)
+		return NULL;
+	memset(buf, 0xa5, (size_t)max_blocks*BLOCK_SIZE);
+
+	for (int i = 0; i < stream->num_recs; i++) {
+		trace_rec_t *rec = &stream->recs[i];
+		if (!read_only)
+			prepare(rec, buf);
+		if (!fast)
+			wait_until(start_ns + rec->ts);
+
+		uint64_t t = trace_now();
+		if (!replay_one(rec, buf))
+			continue;
+		op_stats_t *st = &stream->stats[rec->op];
+		st->count++;
+		st->recorded_ns += rec->latency;
+		st->replayed_ns += trace_now() - t;
+	}
+	free(buf);
+	return NULL;
+}
+
+
+int main(int argc, char **argv) {
+	int opt;
+	while ((opt = getopt(argc, argv, "fr")) != -1) {
+		switch (opt) {
+		case 'f': fast = true; break;
+		case 'r': read_only = true; break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind != argc-2)
+		usage(argv[0]);
+	const char *trace_path = argv[optind], *disk_path = argv[optind+1];
+
+	/* Load the whole trace and split it by thread */
+	FILE *f = fopen(trace_path, "r");
+	if (f == NULL) {
+		perror(trace_path);
+		return 1;
+	}
+	trace_hdr_t hdr;
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != TRACE_MAGIC ||
+		hdr.version != TRACE_VERSION || hdr.rec_size != sizeof(trace_rec_t)) {
+		fprintf(stderr, "%s: not a tfs trace\n", trace_path);
+		return 1;
+	}
+	int num_recs = 0, cap_recs = 4096;
+	trace_rec_t *recs = malloc(cap_recs * sizeof(trace_rec_t));
+	size_t n;
+	while ((n = fread(recs + num_recs, sizeof(trace_rec_t), cap_recs - num_recs, f)) > 0) {
+		num_recs += n;
+		if (num_recs == cap_recs) {
+			cap_recs *= 2;
+			recs = realloc(recs, cap_recs * sizeof(trace_rec_t));
+		}
+	}
+	fclose(f);
+	qsort(recs, num_recs, sizeof(trace_rec_t), cmp_rec);
+
+	int num_streams = 0;
+	stream_t *streams = calloc(num_recs + 1, sizeof(stream_t));
+	op_stats_t fuse_stats[TR_NUM_OPS] = {{0}};
+	for (int i = 0; i < num_recs; i++) {
+		if (recs[i].op >= TR_NUM_OPS)
+			continue;
+		if (recs[i].op >= TR_GETATTR) {
+			fuse_stats[recs[i].op].count++;
+			fuse_stats[recs[i].op].recorded_ns += recs[i].latency;
+		}
+		if (num_streams == 0 || recs[i].tid != streams[num_streams-1].recs[0].tid)
+			streams[num_streams++].recs = &recs[i];
+		streams[num_streams-1].num_recs++;
+		max_blocks = MAX(max_blocks, (int)(recs[i].size / BLOCK_SIZE));
+	}
+
+	/* Open the image the same way tfs does */
+	char block[BLOCK_SIZE];
+	if (dev_open(disk_path, 0) < 0)
+		return 1;
+	bio_read(0, block);
+	memcpy(&superblock, block, sizeof(superblock_t));
+	if (superblock.magic_num != MAGIC_NUM) {
+		fprintf(stderr, "%s: bad magic number, not a tfs image\n", disk_path);
+		return 1;
+	}
+	if (superblock.s_num_disks > 0)
+		dev_set_stripe(superblock.s_stripe_unit);
+	if (superblock.c_num_blk > 0)
+		dev_csum_init(superblock.c_start_blk, superblock.c_num_blk, 0);
+	if (!read_only)
+		classify();
+
+	start_ns = trace_now();
+	for (int s = 0; s < num_streams; s++) {
+		pthread_create(&streams[s].thread, NULL, replay_main, &streams[s]);
+	}
+	for (int s = 0; s < num_streams; s++) {
+		pthread_join(streams[s].thread, NULL);
+	}
+	double elapsed = (trace_now() - start_ns) / 1e9;
+	dev_close();
+
+	/* Report, recorded against replayed latency for each block op */
+	uint64_t total = 0;
+	printf("%-12s %10s %14s %14s\n", "op", "count", "recorded us", "replayed us");
+	for (int op = 1; op < TR_NUM_OPS; op++) {
+		op_stats_t sum = fuse_stats[op];
+		for (int s = 0; s < num_streams; s++) {
+			sum.count += streams[s].stats[op].count;
+			sum.recorded_ns += streams[s].stats[op].recorded_ns;
+			sum.replayed_ns += streams[s].stats[op].replayed_ns;
+		}
+		if (sum.count == 0)
+			continue;
+		if (op < TR_GETATTR) {
+			total += sum.count;
+			printf("%-12s %10" PRIu64 " %14.1f %14.1f\n", trace_op_name(op), sum.count,
+				sum.recorded_ns / 1e3 / sum.count, sum.replayed_ns / 1e3 / sum.count);
+		}
+		else {
+			printf("%-12s %10" PRIu64 " %14.1f %14s\n", trace_op_name(op), sum.count,
+				sum.recorded_ns / 1e3 / sum.count, "-");
+		}
+	}
+	printf("%" PRIu64 " block ops from %d threads in %.3fs (%.0f ops/s)\n", total, num_streams,
+		elapsed, elapsed > 0 ? total / elapsed : 0);
+
+	free(file_data);
+	free(streams);
+	free(recs);
+	return 0;
+}
@@ -0,0 +1,267 @@
+/*
+ *  Copyright (C) 2021 CS416 Rutgers CS
+ *	Tiny File System
+ *
+ *	File:	trace.c
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "trace.h"
+
+#define TRACE_RING		4096	/* records per thread, a power of 2 */
+#define TRACE_FLUSH_MS	100
+
+/* 
+ * Single-producer ring owned by one thread. The owner only moves head and
+ * the flusher only moves tail, so both sides get by with atomic loads and
+ * stores. When the owner exits the ring is retired and the next new thread
+ * takes it over, so FUSE workers coming and going don't add rings.
+ */
+typedef struct trace_ring_t {
+	trace_rec_t		rec[TRACE_RING];
+	uint32_t		head;		/* next slot the owner fills */
+	uint32_t		tail;		/* next slot the flusher drains */
+	uint32_t		dropped;
+	int				retired;	/* owner exited, free to take over */
+	uint16_t		tid;
+	struct trace_ring_t *next;
+} trace_ring_t;
+
+int trace_enabled = 0;
+
+static FILE *trace_file;
+static uint64_t trace_start;
+static int trace_gen;
+static trace_ring_t *rings;		/* every ring, pushed with CAS */
+static int num_rings;
+
+static __thread trace_ring_t *my_ring;
+static __thread int my_gen;		/* trace_gen my_ring belongs to */
+static __thread int my_ino;
+
+static pthread_key_t ring_key;	/* only for its destructor */
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;	/* retiring vs freeing */
+
+static pthread_t flusher;
+static pthread_mutex_t flusher_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flusher_cond = PTHREAD_COND_INITIALIZER;
+static int flusher_stop;
+
+static const char *op_names[TR_NUM_OPS] = {
+	[TR_BIO_READ] = "bio_read",
+	[TR_BIO_WRITE] = "bio_write",
+	[TR_BIO_READV] = "bio_readv",
+	[TR_BIO_WRITEV] = "bio_writev",
+	[TR_BIO_DISCARD] = "bio_discard",
+	[TR_GETATTR] = "getattr",
+	[TR_READDIR] = "readdir",
+	[TR_MKDIR] = "mkdir",
+	[TR_RMDIR] = "rmdir",
+	[TR_CREATE] = "create",
+	[TR_OPEN] = "open",
+	[TR_READ] = "read",
+	[TR_WRITE] = "write",
+	[TR_UNLINK] = "unlink",
+	[TR_RENAME] = "rename",
+	[TR_TRUNCATE] = "truncate",
+	[TR_FALLOCATE] = "fallocate",
+	[TR_IOCTL] = "ioctl",
+	[TR_STATFS] = "statfs",
+};
+
+
+uint64_t trace_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+
+const char *trace_op_name(int op) {
+	if (op <= 0 || op >= TR_NUM_OPS || op_names[op] == NULL)
+		return "unknown";
+	return op_names[op];
+}
+
+
+/* Remembers the inode an op resolved, reported as the arg of FUSE ops */
+void trace_note_ino(int ino) {
+	my_ino = ino;
+}
+
+
+int trace_last_ino() {
+	int ino = my_ino;
+	my_ino = -1;
+	return ino;
+}
+
+
+//Runs at thread exit, my_ring is still this thread's
+static void ring_retire(void *arg) {
+	pthread_mutex_lock(&rings_lock);
+	if (my_ring != NULL && my_gen == trace_gen)
+		__atomic_store_n(&my_ring->retired, 1, __ATOMIC_RELEASE);
+	my_ring = NULL;
+	pthread_mutex_unlock(&rings_lock);
+}
+
+
+static void ring_key_create() {
+	pthread_key_create(&ring_key, ring_retire);
+}
+
+
+static trace_ring_t *ring_get() {
+	if (my_ring != NULL && my_gen == trace_gen)
+		return my_ring;
+
+	/* take over the ring of a thread that exited, records it left included */
+	trace_ring_t *ring;
+	for (ring = rings; ring != NULL; ring = ring->next) {
+		if (__atomic_load_n(&ring->retired, __ATOMIC_RELAXED) &&
+			__sync_bool_compare_and_swap(&ring->retired, 1, 0))
+			break;
+	}
+	if (ring == NULL) {
+		ring = calloc(1, sizeof(trace_ring_t));
+		if (ring == NULL)
+			return NULL;
+		ring->tid = __sync_fetch_and_add(&num_rings, 1);
+		do {
+			ring->next = rings;
+		} while (!__sync_bool_compare_and_swap(&rings, ring->next, ring));
+	}
+	pthread_once(&ring_key_once, ring_key_create);
+	pthread_setspecific(ring_key, ring);
+	my_ring = ring;
+	my_gen = trace_gen;
+	return ring;
+}
+
+
+void trace_record(int op, int arg, uint64_t off, uint32_t size, uint64_t start) {
+	if (!trace_enabled)
+		return;
+	uint64_t end = trace_now();
+	trace_ring_t *ring = ring_get();
+	if (ring == NULL)
+		return;
+
+	uint32_t head = ring->head;
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == TRACE_RING) {
+		ring->dropped++;
+		return;
+	}
+	trace_rec_t *rec = &ring->rec[head % TRACE_RING];
+	rec->ts = start - trace_start;
+	rec->off = off;
+	rec->latency = end - start;
+	rec->arg = arg;
+	rec->size = size;
+	rec->op = op;
+	rec->tid = ring->tid;
+	__atomic_store_n(&ring->head, head+1, __ATOMIC_RELEASE);
+}
+
+
+//Writes out everything the rings hold so far
+static void trace_drain() {
+	for (trace_ring_t *ring = rings; ring != NULL; ring = ring->next) {
+		uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		uint32_t tail = ring->tail;
+		while (tail != head) {
+			/* up to the end of the array at a time */
+			uint32_t n = TRACE_RING - tail % TRACE_RING;
+			if (n > head - tail)
+				n = head - tail;
+			fwrite(&ring->rec[tail % TRACE_RING], sizeof(trace_rec_t), n, trace_file);
+			tail += n;
+		}
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+	}
+}
+
+
+static void *flusher_main(void *arg) {
+	pthread_mutex_lock(&flusher_lock);
+	while (!flusher_stop) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += TRACE_FLUSH_MS * 1000000L;
+		ts.tv_sec += ts.tv_nsec / 1000000000;
+		ts.tv_nsec %= 1000000000;
+		pthread_cond_timedwait(&flusher_cond, &flusher_lock, &ts);
+		trace_drain();
+	}
+	pthread_mutex_unlock(&flusher_lock);
+	return NULL;
+}
+
+
+/* 
+ * Starts tracing to a new file at path. Call after any fork(), the flusher
+ * is a thread.
+ */
+int trace_open(const char *path) {
+	trace_file = fopen(path, "w");
+	if (trace_file == NULL)
+		return -1;
+
+	trace_start = trace_now();
+	trace_hdr_t hdr = { TRACE_MAGIC, TRACE_VERSION, sizeof(trace_rec_t), trace_start };
+	fwrite(&hdr, sizeof(hdr), 1, trace_file);
+
+	trace_gen++;
+	flusher_stop = 0;
+	if (pthread_create(&flusher, NULL, flusher_main, NULL) != 0) {
+		fclose(trace_file);
+		trace_file = NULL;
+		return -1;
+	}
+	trace_enabled = 1;
+	return 0;
+}
+
+
+/* 
+ * Stops tracing and writes out what is left. The rings are freed, so no op
+ * may be in flight.
+ */
+void trace_close() {
+	if (!trace_enabled)
+		return;
+	trace_enabled = 0;
+
+	pthread_mutex_lock(&flusher_lock);
+	flusher_stop = 1;
+	pthread_cond_signal(&flusher_cond);
+	pthread_mutex_unlock(&flusher_lock);
+	pthread_join(flusher, NULL);
+	trace_drain();
+
+	/* a thread exiting now must not retire a ring being freed */
+	pthread_mutex_lock(&rings_lock);
+	trace_gen++;
+	uint32_t dropped = 0;
+	while (rings != NULL) {
+		trace_ring_t *ring = rings;
+		rings = ring->next;
+		dropped += ring->dropped;
+		free(ring);
+	}
+	num_rings = 0;
+	pthread_mutex_unlock(&rings_lock);
+	if (dropped > 0)
+		fprintf(stderr, "trace: dropped %u records, rings were full\n", dropped);
+	fclose(trace_file);
+	trace_file = NULL;
+}
@@ -0,0 +1,90 @@
+/*
+ *  Copyright (C) 2021 CS416 Rutgers CS
+ *	Tiny File System
+ *
+ *	File:	trace.h
+ *
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+/* 
+ * Binary trace of block and FUSE operations. Each thread appends to its own
+ * ring without locks; a flusher thread drains the rings to the trace file.
+ * A record is dropped, and counted, if its ring is full.
+ *
+ * File layout: a trace_hdr_t, then trace_rec_t records. Records are in
+ * order per thread but threads are interleaved, sort by ts to merge them.
+ * A thread that exits hands its ring, and tid, on to the next new thread.
+ */
+#define TRACE_MAGIC		0x54535446	/* "FTST" */
+#define TRACE_VERSION	1
+
+enum trace_op {
+	/* block layer, arg is the first block */
+	TR_BIO_READ = 1,
+	TR_BIO_WRITE,
+	TR_BIO_READV,
+	TR_BIO_WRITEV,
+	TR_BIO_DISCARD,
+
+	/* FUSE ops, arg is the last inode the op looked up */
+	TR_GETATTR = 32,
+	TR_READDIR,
+	TR_MKDIR,
+	TR_RMDIR,
+	TR_CREATE,
+	TR_OPEN,
+	TR_READ,
+	TR_WRITE,
+	TR_UNLINK,
+	TR_RENAME,
+	TR_TRUNCATE,
+	TR_FALLOCATE,
+	TR_IOCTL,
+	TR_STATFS,
+
+	TR_NUM_OPS
+};
+
+typedef struct trace_hdr_t {
+	uint32_t	magic;
+	uint16_t	version;
+	uint16_t	rec_size;		/* sizeof(trace_rec_t) */
+	uint64_t	start_ns;		/* CLOCK_MONOTONIC at trace_open() */
+} trace_hdr_t;
+
+typedef struct trace_rec_t {
+	uint64_t	ts;				/* ns since start_ns */
+	uint64_t	off;			/* byte offset for read/write */
+	uint32_t	latency;		/* ns */
+	int32_t		arg;			/* block or inode number */
+	uint32_t	size;			/* bytes */
+	uint16_t	op;				/* enum trace_op */
+	uint16_t	tid;			/* ring the record came from */
+} trace_rec_t;
+
+extern int trace_enabled;
+
+int trace_open(const char *path);
+void trace_close();
+uint64_t trace_now();
+void trace_record(int op, int arg, uint64_t off, uint32_t size, uint64_t start);
+void trace_note_ino(int ino);
+int trace_last_ino();
+const char *trace_op_name(int op);
+
+/* Start time of an op, 0 when tracing is off */
+static inline uint64_t trace_begin() {
+	return trace_enabled ? trace_now() : 0;
+}
+
+static inline void trace_end(int op, int arg, uint64_t off, uint32_t size, uint64_t start) {
+	if (start != 0)
+		trace_record(op, arg, off, size, start);
+}
+
+#endif